@@ -3,22 +3,153 @@
   Funcionalidades (F3, F4, F5, F6) demonstradas de forma simplificada.
 
   Compilação (exemplo):
-    gcc -o servidor servidor.c
+    gcc -pthread -o servidor server_melhorado.c -lcrypt
 
   Execução:
-    ./servidor <porta>
+    ./servidor <porta> [-i ficheiro_importacao]...
+
+  A opção -i carrega voluntários, associações e desafios em massa a partir
+  de um ficheiro CSV (formato descrito em "Importação e exportação em massa").
+  O administrador pode exportar os dados no mesmo formato pelo seu menu.
+
+  Replicação para escalar as leituras (ver "Replicação primário/réplica"):
+    ./servidor 5000 -p 6000 -k segredo             primário, réplicas ligam-se
+                                                    a 127.0.0.1:6000
+    ./servidor 5000 -p 10.0.0.1:6000 -k segredo    idem, noutro endereço
+    ./servidor 5001 -r 127.0.0.1:6000 -k segredo   réplica, serve leituras na 5001
+  O ficheiro dado por -k contém o segredo partilhado (primeira linha).
+
+  Reinício sem interrupção (ver "Reinício sem interrupção"):
+    ./servidor 5000 -u /tmp/esf.sock   arranca (ou substitui o servidor que
+                                       escuta em /tmp/esf.sock, herdando a
+                                       porta, os dados e as sessões)
+
+  Os anexos dos desafios ficam em ./anexos (ou no diretório dado por -a).
+
+  E/S das conexões (ver "Backend io_uring"):
+    -e threads   recv/send bloqueantes numa thread por conexão (por omissão)
+    -e uring     accept, recv e send por um anel io_uring; se o kernel não o
+                 suportar, o servidor avisa e usa as threads
+
+  Débito de logins do pool de autenticação, sem abrir a porta:
+    ./servidor 5000 -b 500
+
+  Orçamentos de memória (ver "Contabilidade de memória"):
+    -m <MiB>   total do servidor (por omissão metade da memória física)
+    -mu <KiB>  por usuário (1024)     -mc <KiB>  por conexão (8192)
+
+  Após o login é emitido um token de sessão; ao reconectar, o cliente pode
+  enviar "TOKEN <token>" como primeira linha para voltar diretamente ao seu
+  menu sem repetir o login.
 
   Depois, testar via telnet (em outro terminal):
     telnet 127.0.0.1 <porta>
 */
 
+#define _GNU_SOURCE // splice
+
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <stdint.h>
+#include <stdarg.h>
+#include <time.h>
 #include <unistd.h>
+#include <signal.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <dirent.h>
+#include <pthread.h>
+#include <crypt.h>
+#include <sys/random.h>
+#include <sys/mman.h>
+#include <sys/eventfd.h>
+#include <sys/syscall.h>
 #include <sys/types.h>
+#include <sys/stat.h>
+#include <sys/sendfile.h>
 #include <sys/socket.h>
+#include <sys/un.h>
 #include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <arpa/inet.h>
+#include <linux/io_uring.h>
+
+// --------------------------------------------------
+// Contabilidade de memória
+// --------------------------------------------------
+// Os bytes vivos de cada reservatório são contados onde os objetos entram e
+// saem das estruturas. Há três orçamentos, configuráveis na linha de comando:
+//   - global (-m MiB, por omissão metade da memória física): acima dele são
+//     recusados novos registos e sessões, mas as conexões continuam a ser
+//     aceites para que leituras e remoções (que libertam memória) sejam servidas;
+//   - por usuário (-mu KiB): limita o que cada voluntário acumula em
+//     candidaturas;
+//   - por conexão (-mc KiB): uma resposta maior é truncada com um aviso.
+// O administrador consulta os números no seu menu.
+
+typedef enum {
+    MEM_USUARIOS,
+    MEM_DESAFIOS,
+    MEM_CANDIDATURAS,
+    MEM_INDICES,     // índices por nome e tabelas de handles
+    MEM_SESSOES,
+    MEM_LOG,         // log de mutações da replicação
+    MEM_ADMISSAO,    // baldes de fichas por IP
+    MEM_ENTRADA,     // buffers de entrada das conexões
+    MEM_SAIDA,       // textos de saída a enviar
+    MEM_ANEL,        // anel de buffers do io_uring (-e uring)
+    NUM_RESERVATORIOS
+} Reservatorio;
+
+const char *nomesReservatorios[NUM_RESERVATORIOS] = {
+    "Usuarios", "Desafios", "Candidaturas", "Indices e handles", "Sessoes",
+    "Log de replicacao", "Controlo de admissao", "Buffers de entrada", "Textos de saida",
+    "Anel io_uring"
+};
+
+long long memoriaReservatorios[NUM_RESERVATORIOS];
+long long orcamentoGlobal = 0; // definido no main
+long long orcamentoUsuario = 1024 * 1024;
+long long orcamentoConexao = 8 * 1024 * 1024;
+long long picoConexao = 0;     // maior uso observado numa conexão
+
+// Bytes da conexão atendida pela thread (-1 nas threads que não são de clientes)
+static __thread long long memoriaConexao = -1;
+
+// Só o total do reservatório, sem pesar na conexão da thread
+void contaMemoriaPartilhada(Reservatorio r, long long delta) {
+    __atomic_add_fetch(&memoriaReservatorios[r], delta, __ATOMIC_RELAXED);
+}
+
+void contaMemoria(Reservatorio r, long long delta) {
+    contaMemoriaPartilhada(r, delta);
+    if(memoriaConexao < 0 || (r != MEM_ENTRADA && r != MEM_SAIDA)) return;
+
+    memoriaConexao += delta;
+    long long pico = __atomic_load_n(&picoConexao, __ATOMIC_RELAXED);
+    while(memoriaConexao > pico &&
+          !__atomic_compare_exchange_n(&picoConexao, &pico, memoriaConexao, 1,
+                                       __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+}
+
+long long memoriaTotal(void) {
+    long long total = 0;
+    for(int r = 0; r < NUM_RESERVATORIOS; r++) {
+        total += __atomic_load_n(&memoriaReservatorios[r], __ATOMIC_RELAXED);
+    }
+    return total;
+}
+
+int memoriaEsgotada(void) {
+    return memoriaTotal() >= orcamentoGlobal;
+}
+
+// A conexão da thread pode crescer mais 'extra' bytes?
+int cabeNaConexao(long long extra) {
+    return memoriaConexao < 0 || memoriaConexao + extra <= orcamentoConexao;
+}
 
 // --------------------------------------------------
 // Definições de estruturas e listas ligadas
@@ -32,6 +163,186 @@ typedef enum {
 
 #define MAX_STR 100
 
+// --------------------------------------------------
+// Tabela de handles geracionais
+// --------------------------------------------------
+// Um Handle identifica um registo (usuário ou desafio) de forma estável:
+// os 24 bits baixos são o índice do slot e os 8 bits altos a geração.
+// Ao remover um registo a geração do slot avança, pelo que handles antigos
+// deixam de resolver e o slot pode ser reutilizado sem use-after-free.
+// O handle 0 nunca é válido (a geração começa em 1). Um slot que esgotou
+// as gerações é retirado em vez de voltar a 1: um handle antigo que ainda
+// esteja guardado (p.ex. numa candidatura órfã) nunca aponta para outro registo.
+
+typedef uint32_t Handle;
+
+#define HANDLE_INVALIDO       0
+#define HANDLE_BITS_INDICE    24
+#define HANDLE_MASCARA_INDICE ((1u << HANDLE_BITS_INDICE) - 1)
+#define HANDLE_MAX_SLOTS      (1u << HANDLE_BITS_INDICE)
+#define SEM_SLOT_LIVRE        HANDLE_MAX_SLOTS
+#define HANDLE_GERACAO_MAX    255
+
+typedef struct Slot {
+    void *registo;      // NULL quando o slot está livre
+    uint32_t geracao;   // 1..HANDLE_GERACAO_MAX
+    uint32_t proxLivre; // próximo slot da lista de livres
+} Slot;
+
+typedef struct TabelaHandles {
+    Slot *slots;
+    uint32_t usados;        // slots já inicializados (livres ou ocupados)
+    uint32_t capacidade;
+    uint32_t primeiroLivre; // SEM_SLOT_LIVRE se não houver
+} TabelaHandles;
+
+// Reserva um slot para o registo e devolve o seu handle (0 se esgotado)
+Handle alocaHandle(TabelaHandles *t, void *registo) {
+    uint32_t idx;
+
+    if(t->primeiroLivre != SEM_SLOT_LIVRE && t->slots) {
+        idx = t->primeiroLivre;
+        t->primeiroLivre = t->slots[idx].proxLivre;
+    } else {
+        if(t->usados == HANDLE_MAX_SLOTS) return HANDLE_INVALIDO;
+        if(t->usados == t->capacidade) {
+            uint32_t novaCap = t->capacidade ? t->capacidade * 2 : 64;
+            if(novaCap > HANDLE_MAX_SLOTS) novaCap = HANDLE_MAX_SLOTS;
+            Slot *novo = (Slot*)realloc(t->slots, novaCap * sizeof(Slot));
+            if(!novo) return HANDLE_INVALIDO;
+            contaMemoria(MEM_INDICES, (long long)(novaCap - t->capacidade) * sizeof(Slot));
+            t->slots = novo;
+            t->capacidade = novaCap;
+        }
+        idx = t->usados++;
+        t->slots[idx].geracao = 1;
+    }
+
+    t->slots[idx].registo = registo;
+    t->slots[idx].proxLivre = SEM_SLOT_LIVRE;
+    return (t->slots[idx].geracao << HANDLE_BITS_INDICE) | idx;
+}
+
+// Devolve o registo apontado pelo handle, ou NULL se já foi removido
+void* resolveHandle(const TabelaHandles *t, Handle h) {
+    uint32_t idx = h & HANDLE_MASCARA_INDICE;
+    if(h == HANDLE_INVALIDO || idx >= t->usados) return NULL;
+    if(t->slots[idx].geracao != (h >> HANDLE_BITS_INDICE)) return NULL;
+    return t->slots[idx].registo;
+}
+
+// Invalida o handle e devolve o slot à lista de livres (ou retira-o, se
+// a geração já não pode avançar)
+void libertaHandle(TabelaHandles *t, Handle h) {
+    uint32_t idx = h & HANDLE_MASCARA_INDICE;
+    if(!resolveHandle(t, h)) return;
+
+    Slot *s = &t->slots[idx];
+    s->registo = NULL;
+    if(s->geracao == HANDLE_GERACAO_MAX) return;
+    s->geracao++;
+    s->proxLivre = t->primeiroLivre;
+    t->primeiroLivre = idx;
+}
+
+// --------------------------------------------------
+// Índice por nome (login -> usuário, nome -> desafio)
+// --------------------------------------------------
+// Tabela de dispersão com encadeamento. A chave aponta para o campo dentro
+// do próprio registo, que nunca muda de endereço enquanto está indexado.
+
+typedef struct EntradaIndice {
+    const char *chave;
+    Handle h;
+    struct EntradaIndice *next;
+} EntradaIndice;
+
+typedef struct Indice {
+    EntradaIndice **baldes;
+    uint32_t numBaldes;
+    uint32_t numEntradas;
+} Indice;
+
+#define INDICE_BALDES_INICIAIS 1024
+
+// FNV-1a de 32 bits
+uint32_t hashString(const char *s) {
+    uint32_t h = 2166136261u;
+    while(*s) {
+        h ^= (unsigned char)*s++;
+        h *= 16777619u;
+    }
+    return h;
+}
+
+// Devolve o elo que aponta para a entrada com a chave (ou para o NULL final)
+EntradaIndice** procuraEntrada(Indice *ind, const char *chave) {
+    EntradaIndice **pp = &ind->baldes[hashString(chave) & (ind->numBaldes - 1)];
+    while(*pp && strcmp((*pp)->chave, chave) != 0) {
+        pp = &(*pp)->next;
+    }
+    return pp;
+}
+
+Handle procuraIndice(Indice *ind, const char *chave) {
+    if(!ind->baldes) return HANDLE_INVALIDO;
+    EntradaIndice *e = *procuraEntrada(ind, chave);
+    return e ? e->h : HANDLE_INVALIDO;
+}
+
+// Duplica o número de baldes quando o fator de carga passa de 1
+int cresceIndice(Indice *ind) {
+    uint32_t novoNum = ind->numBaldes ? ind->numBaldes * 2 : INDICE_BALDES_INICIAIS;
+    EntradaIndice **novos = (EntradaIndice**)calloc(novoNum, sizeof(EntradaIndice*));
+    if(!novos) return 0;
+
+    for(uint32_t i = 0; i < ind->numBaldes; i++) {
+        EntradaIndice *e = ind->baldes[i];
+        while(e) {
+            EntradaIndice *prox = e->next;
+            uint32_t b = hashString(e->chave) & (novoNum - 1);
+            e->next = novos[b];
+            novos[b] = e;
+            e = prox;
+        }
+    }
+    free(ind->baldes);
+    contaMemoria(MEM_INDICES, (long long)(novoNum - ind->numBaldes) * sizeof(EntradaIndice*));
+    ind->baldes = novos;
+    ind->numBaldes = novoNum;
+    return 1;
+}
+
+// Devolve 0 se a chave já existir ou faltar memória
+int adicionaIndice(Indice *ind, const char *chave, Handle h) {
+    if(ind->numEntradas >= ind->numBaldes && !cresceIndice(ind)) return 0;
+
+    EntradaIndice **pp = procuraEntrada(ind, chave);
+    if(*pp) return 0;
+
+    EntradaIndice *e = (EntradaIndice*)malloc(sizeof(EntradaIndice));
+    if(!e) return 0;
+    e->chave = chave;
+    e->h = h;
+    e->next = NULL;
+    *pp = e;
+    ind->numEntradas++;
+    contaMemoria(MEM_INDICES, sizeof(EntradaIndice));
+    return 1;
+}
+
+void removeIndice(Indice *ind, const char *chave) {
+    if(!ind->baldes) return;
+    EntradaIndice **pp = procuraEntrada(ind, chave);
+    if(!*pp) return;
+
+    EntradaIndice *e = *pp;
+    *pp = e->next;
+    free(e);
+    ind->numEntradas--;
+    contaMemoria(MEM_INDICES, -(long long)sizeof(EntradaIndice));
+}
+
 // Estrutura para armazenar os dados do engenheiro
 typedef struct Engineer {
     char nomeCompleto[MAX_STR];
@@ -64,25 +375,38 @@ typedef struct Challenge {
     char descricao[MAX_STR];
     char tipoEngenheiro[MAX_STR];
     int horasEstimadas;
+    char associacao[MAX_STR]; // login da associação que o criou ("" nos registos antigos)
 
+    Handle id;
+    struct Challenge *prev;
     struct Challenge *next;
 } Challenge;
 
+#define TAM_IDENTIDADE 16 // dígitos hexadecimais da identidade de um usuário
+
 // Estrutura genérica de usuário (pode ser VOLUNTARIO, ASSOCIACAO ou ADMIN)
 typedef struct User {
     UserType userType;
     // Guardamos os dados específicos em uniões ou ponteiros para simplicidade
     Engineer engineerData;
     Association assocData;
+    size_t memoria; // bytes atribuídos ao usuário (registo e candidaturas)
+    // Atribuída pelo primário ao criar o usuário: distingue-o de outro que
+    // mais tarde reutilize o mesmo login (vazia no administrador)
+    char identidade[TAM_IDENTIDADE + 1];
 
+    Handle id;
+    struct User *prev;
     struct User *next;
 } User;
 
 // Estrutura para armazenar candidaturas
+// As referências são handles: se o desafio ou um dos usuários for removido
+// a candidatura fica órfã e é libertada na próxima travessia da lista.
 typedef struct Application {
-    Challenge *desafio;
-    User *engenheiro;
-    User *associacao;
+    Handle desafio;
+    Handle engenheiro;
+    Handle associacao;
     int status; // 0: pendente, 1: aceito, 2: rejeitado
     char mensagem[MAX_STR]; // Mensagem opcional da associação
 
@@ -94,148 +418,579 @@ User *listaUsuarios = NULL;
 Challenge *listaDesafios = NULL;
 Application *listaCandidaturas = NULL;
 
+TabelaHandles tabelaUsuarios = { NULL, 0, 0, SEM_SLOT_LIVRE };
+TabelaHandles tabelaDesafios = { NULL, 0, 0, SEM_SLOT_LIVRE };
+
+Indice indiceLogins = { NULL, 0, 0 };
+Indice indiceDesafios = { NULL, 0, 0 };
+
+// Cada conexão é atendida numa thread; todo o acesso às listas, tabelas de
+// handles e índices acima é feito com este mutex trancado. Nunca se tranca
+// durante send/recv: o texto é formatado primeiro e enviado depois.
+pthread_mutex_t mutexDados = PTHREAD_MUTEX_INITIALIZER;
+
+// --------------------------------------------------
+// Envio e receção nas conexões de clientes
+// --------------------------------------------------
+// Por omissão cada conexão usa recv/send bloqueantes na sua própria thread.
+// Com "-e uring" (ver "Backend io_uring") os sockets dos clientes são servidos
+// por um anel io_uring numa única thread: a thread da conexão continua a
+// correr os menus, mas lê da fila que o anel enche e deixa os envios numa
+// fila que o anel submete em cadeia. enviaCliente e recebeCliente escolhem o
+// caminho conforme a conexão atendida pela thread.
+
+#define LIMITE_FILA_ANEL (256 * 1024) // bytes por enviar/ler antes de esperar
+#define TAM_ENVIO_ANEL (16 * 1024)    // capacidade mínima de um envio da fila
+
+typedef struct ConexaoAnel ConexaoAnel;
+
+// Envio à espera do anel; 'enviado' avança com os envios parciais. Enquanto
+// não for submetido, os envios seguintes da thread juntam-se a ele
+typedef struct EnvioAnel {
+    ConexaoAnel *conexao;
+    struct EnvioAnel *next;
+    size_t tamanho, capacidade;
+    size_t enviado;
+    int submetido;
+    char dados[];
+} EnvioAnel;
+
+// Estado de uma conexão no anel, partilhado entre a thread da conexão e a
+// thread do anel (protegido por mutex)
+struct ConexaoAnel {
+    int fd;
+    pthread_mutex_t mutex;
+    pthread_cond_t mudou;
+
+    // Bytes recebidos pelo anel que a thread ainda não leu
+    char *recebido;
+    size_t inicio, fim, capacidade;
+    int fimEntrada;    // o cliente fechou ou o recv falhou
+    int recebeAtivo;   // recv submetido, à espera da CQE
+    int recebePausado; // fila cheia: o recv volta quando a thread a esvaziar
+
+    // Fila de envios; os primeiros 'emCurso' estão submetidos numa cadeia
+    EnvioAnel *envios, *ultimoEnvio;
+    size_t porEnviar;
+    int emCurso;
+    int falhouEnvio;
+
+    // Protegidos por mutexAgenda
+    int terminada;     // a thread da conexão saiu e não volta a tocar-lhe
+    int agendada;      // está em agendaAnel
+    ConexaoAnel *proximaAgendada;
+
+    // Só a thread do anel
+    int largada;       // o anel já viu 'terminada'
+    ConexaoAnel *seguinteVolta;
+};
+
+int usaAnel = 0;        // -e uring, se o kernel o suportar
+int acordaAnelFd = -1;  // eventfd que tira a thread do anel da espera
+
+// Conexões com trabalho para o anel: envios novos, receção a retomar ou fim
+pthread_mutex_t mutexAgenda = PTHREAD_MUTEX_INITIALIZER;
+ConexaoAnel *agendaAnel = NULL;
+
+// Conexão atendida pela thread, se for servida pelo anel
+static __thread ConexaoAnel *conexaoAnel;
+
+ConexaoAnel* conexaoNoAnel(int sockfd) {
+    return conexaoAnel && conexaoAnel->fd == sockfd ? conexaoAnel : NULL;
+}
+
+// Pede à thread do anel que trate da conexão na próxima volta do ciclo. Com
+// terminar, a thread da conexão larga-a: o anel pode libertá-la assim que a
+// tirar da agenda, por isso a marca é posta com mutexAgenda trancado.
+void agendaConexao(ConexaoAnel *c, int terminar) {
+    int acordar = 0;
+
+    pthread_mutex_lock(&mutexAgenda);
+    if(terminar) c->terminada = 1;
+    if(!c->agendada) {
+        c->agendada = 1;
+        c->proximaAgendada = agendaAnel;
+        acordar = agendaAnel == NULL; // senão o anel já foi acordado
+        agendaAnel = c;
+    }
+    pthread_mutex_unlock(&mutexAgenda);
+
+    uint64_t um = 1;
+    if(acordar && write(acordaAnelFd, &um, sizeof(um)) < 0) perror("Erro ao acordar o anel");
+}
+
+// Como enviaCliente(sockfd, dados, tamanho). No anel os dados são copiados para a
+// fila da conexão e a chamada só espera se a fila passar de LIMITE_FILA_ANEL.
+ssize_t enviaCliente(int sockfd, const void *dados, size_t tamanho) {
+    ConexaoAnel *c = conexaoNoAnel(sockfd);
+    if(!c) return send(sockfd, dados, tamanho, 0);
+    if(!tamanho) return 0;
+
+    pthread_mutex_lock(&c->mutex);
+    while(c->porEnviar > LIMITE_FILA_ANEL && !c->falhouEnvio) pthread_cond_wait(&c->mudou, &c->mutex);
+    if(c->falhouEnvio) {
+        pthread_mutex_unlock(&c->mutex);
+        errno = EPIPE;
+        return -1;
+    }
+
+    // Os menus saem em muitos envios pequenos: juntá-los no último envio
+    // ainda não submetido poupa um send por linha
+    EnvioAnel *u = c->ultimoEnvio;
+    if(u && !u->submetido && u->capacidade - u->tamanho >= tamanho) {
+        memcpy(u->dados + u->tamanho, dados, tamanho);
+        u->tamanho += tamanho;
+    } else {
+        size_t capacidade = tamanho > TAM_ENVIO_ANEL ? tamanho : TAM_ENVIO_ANEL;
+        EnvioAnel *e = (EnvioAnel*)malloc(sizeof(EnvioAnel) + capacidade);
+        if(!e) {
+            pthread_mutex_unlock(&c->mutex);
+            return -1;
+        }
+        e->conexao = c;
+        e->next = NULL;
+        e->tamanho = tamanho;
+        e->capacidade = capacidade;
+        e->enviado = 0;
+        e->submetido = 0;
+        memcpy(e->dados, dados, tamanho);
+        contaMemoriaPartilhada(MEM_SAIDA, sizeof(EnvioAnel) + capacidade);
+        if(u) u->next = e;
+        else c->envios = e;
+        c->ultimoEnvio = e;
+    }
+    c->porEnviar += tamanho;
+    int agendar = !c->emCurso; // com uma cadeia em curso o anel segue sozinho
+    pthread_mutex_unlock(&c->mutex);
+
+    if(agendar) agendaConexao(c, 0);
+    return (ssize_t)tamanho;
+}
+
+// Como recv(sockfd, destino, tamanho, 0): devolve 0 se a conexão fechou
+ssize_t recebeCliente(int sockfd, void *destino, size_t tamanho) {
+    ConexaoAnel *c = conexaoNoAnel(sockfd);
+    if(!c) return recv(sockfd, destino, tamanho, 0);
+
+    pthread_mutex_lock(&c->mutex);
+    while(c->inicio == c->fim && !c->fimEntrada) pthread_cond_wait(&c->mudou, &c->mutex);
+    size_t n = c->fim - c->inicio < tamanho ? c->fim - c->inicio : tamanho;
+    memcpy(destino, c->recebido + c->inicio, n);
+    c->inicio += n;
+    if(c->inicio == c->fim) c->inicio = c->fim = 0;
+
+    int retomar = c->recebePausado && c->fim - c->inicio < LIMITE_FILA_ANEL / 2;
+    if(retomar) c->recebePausado = 0;
+    pthread_mutex_unlock(&c->mutex);
+
+    if(retomar) agendaConexao(c, 0);
+    return (ssize_t)n;
+}
+
+// Espera até esperaMs por dados (ou pelo fecho) da conexão; 1 se chegaram
+int esperaEntrada(int sockfd, int esperaMs) {
+    ConexaoAnel *c = conexaoNoAnel(sockfd);
+    if(!c) {
+        struct pollfd espera = { sockfd, POLLIN, 0 };
+        return poll(&espera, 1, esperaMs) > 0;
+    }
+
+    struct timespec limite;
+    clock_gettime(CLOCK_REALTIME, &limite);
+    limite.tv_sec += esperaMs / 1000;
+    limite.tv_nsec += (long)(esperaMs % 1000) * 1000000;
+    if(limite.tv_nsec >= 1000000000) {
+        limite.tv_sec++;
+        limite.tv_nsec -= 1000000000;
+    }
+
+    pthread_mutex_lock(&c->mutex);
+    while(c->inicio == c->fim && !c->fimEntrada &&
+          pthread_cond_timedwait(&c->mudou, &c->mutex, &limite) == 0);
+    int chegou = c->inicio != c->fim || c->fimEntrada;
+    pthread_mutex_unlock(&c->mutex);
+    return chegou;
+}
+
+// Espera que a fila de envios da conexão fique vazia, antes de escrever no
+// socket por outro caminho (sendfile) ou de o largar
+void esperaEnvios(int sockfd) {
+    ConexaoAnel *c = conexaoNoAnel(sockfd);
+    if(!c) return;
+
+    pthread_mutex_lock(&c->mutex);
+    while(c->porEnviar > 0 && !c->falhouEnvio) pthread_cond_wait(&c->mudou, &c->mutex);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+// Fim da thread da conexão: o que falta enviar sai primeiro e depois o anel
+// fecha o socket, quando já não tiver operações pendentes sobre ele
+void largaConexaoAnel(void) {
+    ConexaoAnel *c = conexaoAnel;
+    esperaEnvios(c->fd);
+    conexaoAnel = NULL;
+    agendaConexao(c, 1);
+}
+
+// --------------------------------------------------
+// Texto de saída (formatado com o mutex trancado, enviado depois)
+// --------------------------------------------------
+
+typedef struct Texto {
+    char *dados;
+    size_t usado;
+    size_t capacidade;
+    int truncado; // a conexão esgotou o orçamento: o resto é descartado
+    int isento;   // registos de mutação: nunca truncados, fora do orçamento
+} Texto;
+
+// Garante espaço para mais 'extra' bytes e o terminador
+int textoReserva(Texto *t, size_t extra) {
+    if(t->truncado) return 0;
+    if(t->usado + extra + 1 <= t->capacidade) return 1;
+
+    size_t novaCap = t->capacidade ? t->capacidade * 2 : 1024;
+    while(novaCap < t->usado + extra + 1) novaCap *= 2;
+    if(!t->isento && !cabeNaConexao(novaCap - t->capacidade)) {
+        t->truncado = 1;
+        return 0;
+    }
+    char *novo = (char*)realloc(t->dados, novaCap);
+    if(!novo) return 0;
+    if(t->isento) contaMemoriaPartilhada(MEM_SAIDA, novaCap - t->capacidade);
+    else contaMemoria(MEM_SAIDA, novaCap - t->capacidade);
+    t->dados = novo;
+    t->capacidade = novaCap;
+    return 1;
+}
+
+void textoLiberta(Texto *t) {
+    if(t->isento) contaMemoriaPartilhada(MEM_SAIDA, -(long long)t->capacidade);
+    else contaMemoria(MEM_SAIDA, -(long long)t->capacidade);
+    free(t->dados);
+    t->dados = NULL;
+    t->usado = t->capacidade = 0;
+    t->truncado = 0;
+}
+
+void textoAvisaTruncado(int sockfd, Texto *t) {
+    const char aviso[] = "\n[Resposta truncada: limite de memoria da conexao atingido]\n";
+    if(t->truncado) enviaCliente(sockfd, aviso, sizeof(aviso) - 1);
+    t->truncado = 0;
+}
+
+void textoAcrescenta(Texto *t, const char *fmt, ...) {
+    va_list args;
+
+    va_start(args, fmt);
+    int len = vsnprintf(NULL, 0, fmt, args);
+    va_end(args);
+    if(len < 0 || !textoReserva(t, len)) return;
+
+    va_start(args, fmt);
+    vsnprintf(t->dados + t->usado, t->capacidade - t->usado, fmt, args);
+    va_end(args);
+    t->usado += len;
+}
+
+// Envia o que já foi acumulado mas mantém o buffer para reutilização
+void textoDespeja(int sockfd, Texto *t) {
+    if(t->usado) enviaCliente(sockfd, t->dados, t->usado);
+    textoAvisaTruncado(sockfd, t);
+    t->usado = 0;
+}
+
+// Envia o texto numa única chamada e liberta-o
+void textoEnvia(int sockfd, Texto *t) {
+    if(t->usado) enviaCliente(sockfd, t->dados, t->usado);
+    textoAvisaTruncado(sockfd, t);
+    textoLiberta(t);
+}
+
 
 // --------------------------------------------------
 // Funções de manipulação de listas
 // --------------------------------------------------
 
+// Login do usuário, que fica em engineerData ou assocData conforme o tipo
+const char* loginUsuario(const User *u) {
+    return u->userType == VOLUNTARIO ? u->engineerData.login : u->assocData.login;
+}
+
 // Insere usuário no início da lista (poderia ser no fim, se preferir)
-void insereUsuario(User *u) {
+// Devolve 0 se o login já existir ou a tabela de handles estiver esgotada.
+int insereUsuario(User *u) {
+    u->id = alocaHandle(&tabelaUsuarios, u);
+    if(u->id == HANDLE_INVALIDO) return 0;
+    if(!adicionaIndice(&indiceLogins, loginUsuario(u), u->id)) {
+        libertaHandle(&tabelaUsuarios, u->id);
+        return 0;
+    }
+
+    u->prev = NULL;
     u->next = listaUsuarios;
+    if(listaUsuarios) listaUsuarios->prev = u;
     listaUsuarios = u;
+    u->memoria = sizeof(User);
+    contaMemoria(MEM_USUARIOS, sizeof(User));
+    return 1;
 }
 
-// Localiza usuário pelo login e senha (para "login" no sistema)
-User* encontraUsuario(const char* login, const char* senha) {
-    User *aux = listaUsuarios;
-    while(aux) {
-        if (aux->userType == VOLUNTARIO) {
-            if (strcmp(aux->engineerData.login, login) == 0 &&
-                strcmp(aux->engineerData.senha, senha) == 0) {
-                return aux;
-            }
-        } else if (aux->userType == ASSOCIACAO) {
-            if (strcmp(aux->assocData.login, login) == 0 &&
-                strcmp(aux->assocData.senha, senha) == 0) {
-                return aux;
-            }
-        } else if (aux->userType == ADMIN) {
-            // No exemplo, os dados do admin estão em assocData (pode ser alterado conforme sua necessidade)
-            if (strcmp(aux->assocData.login, login) == 0 &&
-                strcmp(aux->assocData.senha, senha) == 0) {
-                return aux;
-            }
-        }
-        aux = aux->next;
-    }
-    return NULL;
+User* resolveUsuario(Handle h) {
+    return (User*)resolveHandle(&tabelaUsuarios, h);
+}
+
+// Remove o usuário em O(1); as candidaturas dele caem em cascata preguiçosa
+int removeUsuario(Handle h) {
+    User *u = resolveUsuario(h);
+    if(!u) return 0;
+
+    if(u->prev) u->prev->next = u->next;
+    else listaUsuarios = u->next;
+    if(u->next) u->next->prev = u->prev;
+
+    removeIndice(&indiceLogins, loginUsuario(u));
+    libertaHandle(&tabelaUsuarios, h);
+    free(u);
+    contaMemoria(MEM_USUARIOS, -(long long)sizeof(User));
+    return 1;
+}
+
+// Localiza usuário apenas pelo login
+User* encontraUsuarioPorLogin(const char* login) {
+    return resolveUsuario(procuraIndice(&indiceLogins, login));
+}
+
+// Hash da senha do usuário
+// No exemplo, os dados do admin estão em assocData (pode ser alterado conforme sua necessidade)
+const char* senhaUsuario(const User *u) {
+    return u->userType == VOLUNTARIO ? u->engineerData.senha : u->assocData.senha;
 }
 
 
 // Adiciona um desafio
-void insereDesafio(Challenge *c) {
+// Devolve 0 se o nome já existir ou a tabela de handles estiver esgotada.
+int insereDesafio(Challenge *c) {
+    c->id = alocaHandle(&tabelaDesafios, c);
+    if(c->id == HANDLE_INVALIDO) return 0;
+    if(!adicionaIndice(&indiceDesafios, c->nomeDesafio, c->id)) {
+        libertaHandle(&tabelaDesafios, c->id);
+        return 0;
+    }
+
+    c->prev = NULL;
     c->next = listaDesafios;
+    if(listaDesafios) listaDesafios->prev = c;
     listaDesafios = c;
+    contaMemoria(MEM_DESAFIOS, sizeof(Challenge));
+    return 1;
+}
+
+Challenge* resolveDesafio(Handle h) {
+    return (Challenge*)resolveHandle(&tabelaDesafios, h);
+}
+
+// Remove o desafio em O(1); as candidaturas a ele caem em cascata preguiçosa
+int removeDesafio(Handle h) {
+    Challenge *c = resolveDesafio(h);
+    if(!c) return 0;
+
+    if(c->prev) c->prev->next = c->next;
+    else listaDesafios = c->next;
+    if(c->next) c->next->prev = c->prev;
+
+    removeIndice(&indiceDesafios, c->nomeDesafio);
+    libertaHandle(&tabelaDesafios, h);
+    free(c);
+    contaMemoria(MEM_DESAFIOS, -(long long)sizeof(Challenge));
+    return 1;
 }
 
 // Lista todos os desafios para engenheiros verem
 void listaTodosDesafios(int sockfd) {
-    char buffer[1024];
+    Texto t = { NULL, 0, 0, 0, 0 };
+
+    pthread_mutex_lock(&mutexDados);
     Challenge *aux = listaDesafios;
 
     if(!aux) {
-        snprintf(buffer, sizeof(buffer), "Nenhum desafio cadastrado no momento.\n");
-        send(sockfd, buffer, strlen(buffer), 0);
-        return;
+        textoAcrescenta(&t, "Nenhum desafio cadastrado no momento.\n");
+    } else {
+        textoAcrescenta(&t, "=== Lista de Desafios ===\n");
     }
 
-    snprintf(buffer, sizeof(buffer), "=== Lista de Desafios ===\n");
-    send(sockfd, buffer, strlen(buffer), 0);
-
     while(aux) {
-        snprintf(buffer, sizeof(buffer),
+        textoAcrescenta(&t,
                  "Nome: %s\nDescricao: %s\nTipo de Engenheiro: %s\nHoras Estimadas: %d\n\n",
                  aux->nomeDesafio, aux->descricao,
                  aux->tipoEngenheiro, aux->horasEstimadas);
-        send(sockfd, buffer, strlen(buffer), 0);
 
         aux = aux->next;
     }
+    pthread_mutex_unlock(&mutexDados);
+
+    textoEnvia(sockfd, &t);
 }
 
-// Função para criar nova candidatura
-void insereCandidatura(Challenge *desafio, User *engenheiro, User *associacao) {
+// Função para criar nova candidatura (devolve 0 se faltar memória)
+int insereCandidatura(Challenge *desafio, User *engenheiro, User *associacao) {
     Application *app = (Application*)malloc(sizeof(Application));
-    if(!app) return;
+    if(!app) return 0;
 
-    app->desafio = desafio;
-    app->engenheiro = engenheiro;
-    app->associacao = associacao;
+    app->desafio = desafio->id;
+    app->engenheiro = engenheiro->id;
+    app->associacao = associacao->id;
     app->status = 0; // pendente
     memset(app->mensagem, 0, MAX_STR);
 
     app->next = listaCandidaturas;
     listaCandidaturas = app;
+    engenheiro->memoria += sizeof(Application);
+    contaMemoria(MEM_CANDIDATURAS, sizeof(Application));
+    return 1;
 }
 
-// Função para encontrar um desafio pelo nome
-Challenge* encontraDesafio(const char* nome) {
-    Challenge *aux = listaDesafios;
-    while(aux) {
-        if(strcmp(aux->nomeDesafio, nome) == 0) {
-            return aux;
+// Devolve a candidatura em *pp, libertando antes as que ficaram órfãs
+// (desafio ou usuário removido). Assim a remoção não precisa de varrer
+// a lista: a limpeza acontece na próxima travessia.
+Application* candidaturaValida(Application **pp) {
+    while(*pp) {
+        Application *app = *pp;
+        if(resolveDesafio(app->desafio) &&
+           resolveUsuario(app->engenheiro) &&
+           resolveUsuario(app->associacao)) {
+            return app;
         }
-        aux = aux->next;
+        User *engenheiro = resolveUsuario(app->engenheiro);
+        if(engenheiro) engenheiro->memoria -= sizeof(Application);
+        *pp = app->next;
+        free(app);
+        contaMemoria(MEM_CANDIDATURAS, -(long long)sizeof(Application));
     }
     return NULL;
 }
 
+// Função para encontrar um desafio pelo nome
+Challenge* encontraDesafio(const char* nome) {
+    return resolveDesafio(procuraIndice(&indiceDesafios, nome));
+}
+
 // Função para listar candidaturas de um engenheiro
-void listaCandidaturasEngenheiro(int sockfd, User *engenheiro) {
-    char buffer[1024];
-    Application *aux = listaCandidaturas;
-    int encontrou = 0;
+void listaCandidaturasEngenheiro(int sockfd, Handle engenheiro) {
+    Texto t = { NULL, 0, 0, 0, 0 };
+    Application **pp = &listaCandidaturas, *aux;
 
-    while(aux) {
+    pthread_mutex_lock(&mutexDados);
+    while((aux = candidaturaValida(pp)) != NULL) {
         if(aux->engenheiro == engenheiro) {
-            encontrou = 1;
-            snprintf(buffer, sizeof(buffer),
+            textoAcrescenta(&t,
                     "\nDesafio: %s\nStatus: %s\nMensagem: %s\n",
-                    aux->desafio->nomeDesafio,
+                    resolveDesafio(aux->desafio)->nomeDesafio,
                     aux->status == 0 ? "Pendente" : 
                     aux->status == 1 ? "Aceito" : "Rejeitado",
                     aux->mensagem[0] ? aux->mensagem : "Sem mensagem");
-            send(sockfd, buffer, strlen(buffer), 0);
         }
-        aux = aux->next;
+        pp = &aux->next;
     }
+    pthread_mutex_unlock(&mutexDados);
 
-    if(!encontrou) {
-        send(sockfd, "Você não tem candidaturas.\n", 28, 0);
+    if(!t.usado) {
+        enviaCliente(sockfd, "Você não tem candidaturas.\n", 28);
     }
+    textoEnvia(sockfd, &t);
 }
 
-// Função para listar candidaturas para uma associação
-void listaCandidaturasAssociacao(int sockfd, User *associacao) {
-    char buffer[1024];
-    Application *aux = listaCandidaturas;
-    int encontrou = 0;
+// Candidatura pendente tal como aparece na página numerada da associação
+typedef struct ItemRevisao {
+    char desafio[MAX_STR];
+    char engenheiro[MAX_STR]; // login
+} ItemRevisao;
 
-    while(aux) {
+// Mostra numa só página, numerada, todas as candidaturas pendentes da
+// associação (uma passagem pela lista). Devolve quantas são e, em *itens, o
+// necessário para decidir cada uma pelo número (a libertar pelo chamador)
+// Se a página não couber inteira devolve 0: um lote decidido sobre uma página
+// truncada casaria números com candidaturas que o utilizador não viu.
+int listaCandidaturasAssociacao(int sockfd, Handle associacao, ItemRevisao **itens) {
+    Texto t = { NULL, 0, 0, 0, 0 };
+    Application **pp = &listaCandidaturas, *aux;
+    int num = 0, capacidade = 0;
+
+    *itens = NULL;
+    textoAcrescenta(&t, "\n=== Candidaturas pendentes ===\n");
+
+    pthread_mutex_lock(&mutexDados);
+    while((aux = candidaturaValida(pp)) != NULL) {
         if(aux->associacao == associacao && aux->status == 0) {
-            encontrou = 1;
-            snprintf(buffer, sizeof(buffer),
-                    "\nDesafio: %s\nEngenheiro: %s\nStatus: Pendente\n",
-                    aux->desafio->nomeDesafio,
-                    aux->engenheiro->engineerData.nomeCompleto);
-            send(sockfd, buffer, strlen(buffer), 0);
+            if(num == capacidade) {
+                capacidade = capacidade ? capacidade * 2 : 16;
+                ItemRevisao *maior = (ItemRevisao*)realloc(*itens, capacidade * sizeof(ItemRevisao));
+                if(!maior) break;
+                *itens = maior;
+            }
+            const char *desafio = resolveDesafio(aux->desafio)->nomeDesafio;
+            const User *engenheiro = resolveUsuario(aux->engenheiro);
+            snprintf((*itens)[num].desafio, MAX_STR, "%s", desafio);
+            snprintf((*itens)[num].engenheiro, MAX_STR, "%s", loginUsuario(engenheiro));
+            num++;
+            textoAcrescenta(&t, "%3d. Desafio: %s | Engenheiro: %s (%s)\n", num, desafio,
+                            engenheiro->engineerData.nomeCompleto, engenheiro->engineerData.especialidade);
         }
-        aux = aux->next;
+        pp = &aux->next;
     }
+    // Parou a meio (sem memória para os itens) ou a página foi truncada: os
+    // números que o utilizador veria não cobrem todas as pendentes
+    int incompleta = aux != NULL || t.truncado;
+    pthread_mutex_unlock(&mutexDados);
+
+    if(incompleta) {
+        const char *aviso = "Lista de candidaturas pendentes incompleta (limite de memoria "
+                            "da conexao): decisoes em lote indisponiveis.\n";
+        textoLiberta(&t);
+        free(*itens);
+        *itens = NULL;
+        enviaCliente(sockfd, aviso, strlen(aviso));
+        return 0;
+    }
+    if(!num) {
+        const char *vazia = "Não há candidaturas pendentes.\n";
+        textoLiberta(&t);
+        enviaCliente(sockfd, vazia, strlen(vazia));
+        return 0;
+    }
+    textoEnvia(sockfd, &t);
+    return num;
+}
 
-    if(!encontrou) {
-        send(sockfd, "Não há candidaturas pendentes.\n", 31, 0);
+// Interpreta decisões como "aceitar 1,3,7 rejeitar 2" ou "a 1-5 r 6": põe em
+// decisoes[i] 1 (aceitar) ou 2 (rejeitar) para os itens indicados. Devolve o
+// número de itens decididos, ou -1 se a linha for inválida ou contraditória.
+int interpretaDecisoes(char *linha, int numItens, int *decisoes) {
+    int status = 0, total = 0;
+    char *guarda;
+
+    for(char *p = strtok_r(linha, " ,", &guarda); p; p = strtok_r(NULL, " ,", &guarda)) {
+        if(strcmp(p, "aceitar") == 0 || strcmp(p, "a") == 0) {
+            status = 1;
+            continue;
+        }
+        if(strcmp(p, "rejeitar") == 0 || strcmp(p, "r") == 0) {
+            status = 2;
+            continue;
+        }
+
+        char *fim;
+        long de = strtol(p, &fim, 10), ate = de;
+        if(*fim == '-') ate = strtol(fim + 1, &fim, 10);
+        if(fim == p || *fim || status == 0 || de < 1 || de > ate || ate > numItens) return -1;
+
+        for(long i = de - 1; i < ate; i++) {
+            if(decisoes[i] && decisoes[i] != status) return -1;
+            if(!decisoes[i]) total++;
+            decisoes[i] = status;
+        }
     }
+    return total;
 }
 
 // Função para processar uma candidatura
@@ -248,131 +1003,3284 @@ void processaCandidatura(Application *app, int aceitar, const char *mensagem) {
 }
 
 // --------------------------------------------------
-// Funções de registro (F4) e menu principal (F3)
+// Hash de senhas (pool de threads de autenticação)
 // --------------------------------------------------
+// As senhas são guardadas com yescrypt (libcrypt), um KDF memory-hard, e
+// nunca em texto simples. Cada hash custa dezenas de ms de CPU, por isso é
+// calculado por um pool fixo de NUM_THREADS_AUTH threads alimentado por uma
+// fila limitada. A thread da conexão fica suspensa até o hash estar pronto;
+// como no máximo NUM_THREADS_AUTH hashes correm em simultâneo, um pico de
+// logins não rouba o CPU às restantes conexões. Com a fila cheia o pedido é
+// recusado de imediato em vez de acumular espera.
 
-// Função auxiliar para remover \r\n
-void removeNewline(char *str) {
-    str[strcspn(str, "\r\n")] = 0;
-}
+#define NUM_THREADS_AUTH 2
+#define TAM_FILA_AUTH    64
+#define CUSTO_YESCRYPT   5 // custo do crypt_gensalt: ~16 MiB e ~25 ms por hash
+#define PREFIXO_HASH     "$y$"
 
-// Cadastro de usuário VOLUNTARIO
-void cadastrarVoluntario(int sockfd) {
-    char buffer[1024];
-    User *u = (User *) malloc(sizeof(User));
-    if(!u) return;
+// Resultados de calculaHash e verificaSenha
+#define SENHA_OCUPADO  -1 // fila do pool cheia: nada foi calculado
+#define SENHA_ERRADA    0
+#define SENHA_CORRETA   1
 
-    u->userType = VOLUNTARIO;
+typedef struct TarefaAuth {
+    const char *senha;
+    const char *config;  // hash guardado (verificação) ou salt novo (cadastro)
+    char resultado[CRYPT_OUTPUT_SIZE];
+    int concluida;
+} TarefaAuth;
 
-    // Coletando dados
-    send(sockfd, "Nome completo: ", 16, 0);
-    recv(sockfd, u->engineerData.nomeCompleto, MAX_STR, 0);
-    removeNewline(u->engineerData.nomeCompleto);
+typedef struct FilaAuth {
+    pthread_mutex_t mutex;
+    pthread_cond_t temTarefas;
+    pthread_cond_t concluiu;
+    TarefaAuth *tarefas[TAM_FILA_AUTH];
+    int inicio;
+    int quantidade;
+} FilaAuth;
 
-    send(sockfd, "OE number: ", 11, 0);
-    recv(sockfd, u->engineerData.oeNumber, MAX_STR, 0);
-    removeNewline(u->engineerData.oeNumber);
+FilaAuth filaAuth = { PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                      PTHREAD_COND_INITIALIZER, { NULL }, 0, 0 };
 
-    send(sockfd, "Especialidade: ", 16, 0);
-    recv(sockfd, u->engineerData.especialidade, MAX_STR, 0);
-    removeNewline(u->engineerData.especialidade);
+// crypt_r com o estado da thread; resultado vazio se falhar
+void aplicaCrypt(const char *senha, const char *config, struct crypt_data *dados,
+                 char resultado[CRYPT_OUTPUT_SIZE]) {
+    char *hash = crypt_r(senha, config, dados);
+    if(hash && hash[0] != '*') {
+        snprintf(resultado, CRYPT_OUTPUT_SIZE, "%s", hash);
+    } else {
+        resultado[0] = 0;
+    }
+}
 
-    send(sockfd, "Instituicao de emprego: ", 25, 0);
-    recv(sockfd, u->engineerData.instituicao, MAX_STR, 0);
-    removeNewline(u->engineerData.instituicao);
+void* trabalhadorAuth(void *arg) {
+    (void)arg;
+    struct crypt_data *dados = (struct crypt_data*)calloc(1, sizeof(struct crypt_data));
+    if(!dados) return NULL;
 
-    send(sockfd, "Ainda é estudante? (0/1): ", 27, 0);
-    recv(sockfd, buffer, 1024, 0);
-    removeNewline(buffer);
-    u->engineerData.aindaEstudante = atoi(buffer);
+    while(1) {
+        pthread_mutex_lock(&filaAuth.mutex);
+        while(filaAuth.quantidade == 0) {
+            pthread_cond_wait(&filaAuth.temTarefas, &filaAuth.mutex);
+        }
+        TarefaAuth *t = filaAuth.tarefas[filaAuth.inicio];
+        filaAuth.inicio = (filaAuth.inicio + 1) % TAM_FILA_AUTH;
+        filaAuth.quantidade--;
+        pthread_mutex_unlock(&filaAuth.mutex);
 
-    send(sockfd, "Areas de expertise: ", 20, 0);
-    recv(sockfd, u->engineerData.areasExpertise, MAX_STR, 0);
-    removeNewline(u->engineerData.areasExpertise);
+        aplicaCrypt(t->senha, t->config, dados, t->resultado);
 
-    send(sockfd, "Email: ", 7, 0);
-    recv(sockfd, u->engineerData.email, MAX_STR, 0);
-    removeNewline(u->engineerData.email);
+        pthread_mutex_lock(&filaAuth.mutex);
+        t->concluida = 1;
+        pthread_cond_broadcast(&filaAuth.concluiu);
+        pthread_mutex_unlock(&filaAuth.mutex);
+    }
+    return NULL;
+}
 
-    send(sockfd, "Telefone (opcional): ", 21, 0);
-    recv(sockfd, u->engineerData.telefone, MAX_STR, 0);
-    removeNewline(u->engineerData.telefone);
+void iniciaPoolAuth(void) {
+    for(int i = 0; i < NUM_THREADS_AUTH; i++) {
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, trabalhadorAuth, NULL) != 0) {
+            perror("Erro ao criar thread de autenticacao");
+            exit(1);
+        }
+        pthread_detach(thread);
+    }
+}
 
-    send(sockfd, "Login desejado: ", 17, 0);
-    recv(sockfd, u->engineerData.login, MAX_STR, 0);
-    removeNewline(u->engineerData.login);
+// Calcula crypt(senha, config) no pool e espera pelo resultado.
+// Devolve 1, SENHA_OCUPADO se a fila estiver cheia ou 0 se o cálculo falhar.
+int calculaHash(const char *senha, const char *config, char resultado[CRYPT_OUTPUT_SIZE]) {
+    TarefaAuth t;
+    t.senha = senha;
+    t.config = config;
+    t.concluida = 0;
 
-    send(sockfd, "Senha desejada: ", 17, 0);
-    recv(sockfd, u->engineerData.senha, MAX_STR, 0);
-    removeNewline(u->engineerData.senha);
+    pthread_mutex_lock(&filaAuth.mutex);
+    if(filaAuth.quantidade == TAM_FILA_AUTH) {
+        pthread_mutex_unlock(&filaAuth.mutex);
+        return SENHA_OCUPADO;
+    }
+    filaAuth.tarefas[(filaAuth.inicio + filaAuth.quantidade) % TAM_FILA_AUTH] = &t;
+    filaAuth.quantidade++;
+    pthread_cond_signal(&filaAuth.temTarefas);
 
-    insereUsuario(u);
-    send(sockfd, "Voluntario cadastrado com sucesso!\n", 36, 0);
-}
+    while(!t.concluida) {
+        pthread_cond_wait(&filaAuth.concluiu, &filaAuth.mutex);
+    }
+    pthread_mutex_unlock(&filaAuth.mutex);
 
-// Cadastro de usuário ASSOCIACAO
-void cadastrarAssociacao(int sockfd) {
-    char buffer[1024];
-    User *u = (User *) malloc(sizeof(User));
-    if(!u) return;
+    memcpy(resultado, t.resultado, CRYPT_OUTPUT_SIZE);
+    return resultado[0] != 0;
+}
 
-    u->userType = ASSOCIACAO;
+// Substitui a senha em texto simples pelo seu hash (devolve 0 se falhar)
+int hashSenha(char senha[MAX_STR]) {
+    char salt[CRYPT_GENSALT_OUTPUT_SIZE];
+    char hash[CRYPT_OUTPUT_SIZE];
 
-    send(sockfd, "Nome da Organizacao: ", 22, 0);
-    recv(sockfd, u->assocData.nomeOrganizacao, MAX_STR, 0);
-    removeNewline(u->assocData.nomeOrganizacao);
+    if(!crypt_gensalt_rn(PREFIXO_HASH, CUSTO_YESCRYPT, NULL, 0, salt, sizeof(salt))) return 0;
+    if(calculaHash(senha, salt, hash) != 1 || strlen(hash) >= MAX_STR) return 0;
 
-    send(sockfd, "NIF: ", 6, 0);
-    recv(sockfd, u->assocData.nif, MAX_STR, 0);
-    removeNewline(u->assocData.nif);
+    strcpy(senha, hash);
+    return 1;
+}
 
-    send(sockfd, "Email: ", 7, 0);
-    recv(sockfd, u->assocData.email, MAX_STR, 0);
-    removeNewline(u->assocData.email);
+// Hash de uma senha que ninguém conhece, calculado no arranque: um login
+// inexistente é verificado contra ele e custa o mesmo que um verdadeiro
+char hashFicticio[MAX_STR];
 
-    send(sockfd, "Endereco: ", 10, 0);
-    recv(sockfd, u->assocData.endereco, MAX_STR, 0);
-    removeNewline(u->assocData.endereco);
+void preparaHashFicticio(void) {
+    unsigned char aleatorio[16];
+    if(getrandom(aleatorio, sizeof(aleatorio), 0) != (ssize_t)sizeof(aleatorio)) {
+        memset(aleatorio, 0, sizeof(aleatorio));
+    }
+    for(size_t i = 0; i < sizeof(aleatorio); i++) {
+        snprintf(hashFicticio + 2 * i, 3, "%02x", aleatorio[i]);
+    }
+    if(!hashSenha(hashFicticio)) {
+        fprintf(stderr, "Erro ao calcular o hash ficticio\n");
+        exit(1);
+    }
+}
 
-    send(sockfd, "Descricao de Atividades: ", 25, 0);
-    recv(sockfd, u->assocData.descricaoAtividades, MAX_STR, 0);
-    removeNewline(u->assocData.descricaoAtividades);
+// Compara em tempo constante para não revelar o prefixo correto. Sem hash
+// guardado (login inexistente) faz o mesmo trabalho e devolve SENHA_ERRADA.
+int verificaSenha(const char *senha, const char *hashGuardado) {
+    char hash[CRYPT_OUTPUT_SIZE];
+    const char *referencia = hashGuardado ? hashGuardado : hashFicticio;
+    int r = calculaHash(senha, referencia, hash);
+    if(r != 1) return r == SENHA_OCUPADO ? SENHA_OCUPADO : SENHA_ERRADA;
 
-    send(sockfd, "Telefone (opcional): ", 21, 0);
-    recv(sockfd, u->assocData.telefone, MAX_STR, 0);
-    removeNewline(u->assocData.telefone);
+    size_t len = strlen(referencia);
+    if(strlen(hash) != len) return SENHA_ERRADA;
 
-    send(sockfd, "Login desejado: ", 17, 0);
-    recv(sockfd, u->assocData.login, MAX_STR, 0);
-    removeNewline(u->assocData.login);
+    unsigned char diferenca = 0;
+    for(size_t i = 0; i < len; i++) {
+        diferenca |= (unsigned char)(hash[i] ^ referencia[i]);
+    }
+    return diferenca == 0 && hashGuardado ? SENHA_CORRETA : SENHA_ERRADA;
+}
 
-    send(sockfd, "Senha desejada: ", 17, 0);
-    recv(sockfd, u->assocData.senha, MAX_STR, 0);
-    removeNewline(u->assocData.senha);
+// --------------------------------------------------
+// Leitura das respostas do cliente
+// --------------------------------------------------
 
-    insereUsuario(u);
-    send(sockfd, "Associacao cadastrada com sucesso!\n", 36, 0);
+// Função auxiliar para remover \r\n
+void removeNewline(char *str) {
+    str[strcspn(str, "\r\n")] = 0;
 }
 
-// Menu para voluntário (engenheiro)
-void menuVoluntario(int sockfd, User* u) {
-    char buffer[1024];
-    int sair = 0;
+// Leitura de linhas com buffer por conexão: cada recv lê tudo o que já
+// chegou e as linhas são servidas a partir do buffer. Um cliente que envie
+// várias respostas de uma vez (p.ex. um cadastro completo) é atendido com
+// um único recv em vez de um por campo. Cada conexão tem a sua thread, pelo
+// que o buffer é local à thread.
+#define TAM_BUFFER_ENTRADA 4096
 
-    while(!sair) {
+typedef struct BufferEntrada {
+    char dados[TAM_BUFFER_ENTRADA];
+    size_t inicio;
+    size_t fim;
+} BufferEntrada;
+
+static __thread BufferEntrada entrada;
+
+// Compacta o que sobrou no buffer e lê mais; devolve 0 se a conexão fechou
+int leMaisEntrada(int sockfd) {
+    memmove(entrada.dados, entrada.dados + entrada.inicio, entrada.fim - entrada.inicio);
+    entrada.fim -= entrada.inicio;
+    entrada.inicio = 0;
+
+    ssize_t n = recebeCliente(sockfd, entrada.dados + entrada.fim, TAM_BUFFER_ENTRADA - entrada.fim);
+    if(n <= 0) return 0;
+    entrada.fim += n;
+    return 1;
+}
+
+// Lê uma linha (sem \r\n) para destino, truncada a tamanho-1 caracteres.
+// Devolve o comprimento, ou -1 (com destino vazio) se a conexão fechou.
+int recebeLinha(int sockfd, char *destino, size_t tamanho) {
+    while(1) {
+        char *nl = memchr(entrada.dados + entrada.inicio, '\n', entrada.fim - entrada.inicio);
+        int cheio = entrada.inicio == 0 && entrada.fim == TAM_BUFFER_ENTRADA;
+
+        if(nl || cheio) {
+            size_t len = nl ? (size_t)(nl - (entrada.dados + entrada.inicio)) : entrada.fim;
+            size_t copia = len < tamanho - 1 ? len : tamanho - 1;
+            memcpy(destino, entrada.dados + entrada.inicio, copia);
+            destino[copia] = 0;
+            removeNewline(destino);
+            entrada.inicio += nl ? len + 1 : len;
+            return (int)strlen(destino);
+        }
+
+        if(!leMaisEntrada(sockfd)) {
+            destino[0] = 0;
+            return -1;
+        }
+    }
+}
+
+// Indica se a entrada começa por 'prefixo', esperando até esperaMs por cada
+// leitura. Nada é consumido: a linha continua disponível para recebeLinha.
+int entradaComecaPor(int sockfd, const char *prefixo, int esperaMs) {
+    size_t len = strlen(prefixo);
+
+    while(entrada.fim - entrada.inicio < len &&
+          !memchr(entrada.dados + entrada.inicio, '\n', entrada.fim - entrada.inicio)) {
+        if(!esperaEntrada(sockfd, esperaMs) || !leMaisEntrada(sockfd)) break;
+    }
+    return entrada.fim - entrada.inicio >= len &&
+           memcmp(entrada.dados + entrada.inicio, prefixo, len) == 0;
+}
+
+// Retira até 'max' bytes já recebidos mas ainda não consumidos (dados
+// binários que seguem uma linha, como o conteúdo de um anexo)
+size_t retiraDoBuffer(char *destino, size_t max) {
+    size_t n = entrada.fim - entrada.inicio;
+    if(n > max) n = max;
+    memcpy(destino, entrada.dados + entrada.inicio, n);
+    entrada.inicio += n;
+    return n;
+}
+
+// --------------------------------------------------
+// Importação e exportação em massa (administrador)
+// --------------------------------------------------
+// Um registo por linha, campos separados por ';':
+//   V;nome;oeNumber;especialidade;instituicao;estudante(0/1);areas;email;telefone;login;senha[;identidade]
+//   A;organizacao;nif;email;endereco;atividades;telefone;login;senha[;identidade]
+//   D;nome;descricao;tipoEngenheiro;horas[;associacao]
+// (associacao é o login da associação dona do desafio; sem ela o desafio
+// não tem dono e não aceita anexos; identidade são TAM_IDENTIDADE dígitos
+// hexadecimais que o primário atribui aos usuários que não a tragam) ou, em NDJSON, um objeto por linha com "tipo" e as chaves de
+// formatosRegisto, p.ex. {"tipo":"D","nome":"Ponte","descricao":"...",
+// "tipoEngenheiro":"Civil","horas":40}. As linhas NDJSON são convertidas
+// para a linha CSV equivalente e seguem o mesmo caminho.
+// Linhas vazias ou começadas por '#' são ignoradas. A senha pode vir em
+// texto simples ou já em hash yescrypt. A exportação produz qualquer dos
+// formatos (com as senhas em hash), pelo que o resultado pode ser reimportado.
+//
+// As senhas em texto simples dominam o tempo de importação (um yescrypt por
+// linha). As linhas são agrupadas em blocos de BLOCO_IMPORTACAO e, antes de
+// as inserir por ordem, os hashes do bloco são calculados em paralelo. No
+// arranque (-i) a importação usa uma thread por CPU, porque ainda não há
+// conexões; pelo menu do administrador usa NUM_THREADS_AUTH, como o pool dos
+// logins, e cada bloco é aplicado com uma única passagem pelo mutex.
+
+#define SEP_CAMPOS ';'
+#define MAX_CAMPOS 12
+#define MAX_LINHA_IMPORTACAO 2048
+#define TAM_BLOCO_EXPORTACAO 65536
+#define BLOCO_IMPORTACAO 1024
+#define MAX_THREADS_IMPORTACAO 64
+#define ESPACOS_JSON " \t\r"
+
+// Chaves NDJSON de cada tipo de registo, pela ordem dos campos CSV
+typedef struct FormatoRegisto {
+    char tipo;
+    const char *chaves[MAX_CAMPOS]; // terminadas em NULL
+} FormatoRegisto;
+
+const FormatoRegisto formatosRegisto[] = {
+    { 'V', { "nome", "oeNumber", "especialidade", "instituicao", "estudante",
+             "areas", "email", "telefone", "login", "senha", "identidade", NULL } },
+    { 'A', { "organizacao", "nif", "email", "endereco", "atividades",
+             "telefone", "login", "senha", "identidade", NULL } },
+    { 'D', { "nome", "descricao", "tipoEngenheiro", "horas", "associacao", NULL } },
+};
+
+#define NUM_FORMATOS (int)(sizeof(formatosRegisto) / sizeof(formatosRegisto[0]))
+
+const FormatoRegisto* formatoRegisto(char tipo) {
+    for(int i = 0; i < NUM_FORMATOS; i++) {
+        if(formatosRegisto[i].tipo == tipo) return &formatosRegisto[i];
+    }
+    return NULL;
+}
+
+// Parte a linha em campos (no próprio buffer). Devolve o número de campos,
+// ou MAX_CAMPOS + 1 se houver campos a mais.
+int divideCampos(char *linha, char **campos) {
+    int n = 0;
+    char *p = linha;
+    while(p) {
+        if(n == MAX_CAMPOS) return MAX_CAMPOS + 1;
+        campos[n++] = p;
+        p = strchr(p, SEP_CAMPOS);
+        if(p) *p++ = 0;
+    }
+    return n;
+}
+
+// Copia os campos para os destinos; falha se algum não couber em MAX_STR
+int copiaCampos(char **destinos, char **campos, int n) {
+    for(int i = 0; i < n; i++) {
+        size_t len = strlen(campos[i]);
+        if(len >= MAX_STR) return 0;
+        memcpy(destinos[i], campos[i], len + 1);
+    }
+    return 1;
+}
+
+// Senhas já em hash (como as da exportação) são aceites tal como estão;
+// as restantes são convertidas, o que domina o tempo de importação
+int protegeSenha(char senha[MAX_STR]) {
+    return strncmp(senha, PREFIXO_HASH, strlen(PREFIXO_HASH)) == 0 || hashSenha(senha);
+}
+
+// Identidade nova para um usuário (64 bits aleatórios em hexadecimal)
+int novaIdentidade(char identidade[TAM_IDENTIDADE + 1]) {
+    unsigned char aleatorio[TAM_IDENTIDADE / 2];
+    if(getrandom(aleatorio, sizeof(aleatorio), 0) != (ssize_t)sizeof(aleatorio)) return 0;
+    for(size_t i = 0; i < sizeof(aleatorio); i++) {
+        snprintf(identidade + 2 * i, 3, "%02x", aleatorio[i]);
+    }
+    return 1;
+}
+
+// Copia o campo opcional da identidade (vazio se não vier); devolve o erro ou NULL
+const char* leIdentidade(User *u, char **campos, int n, int numCampos) {
+    const char *identidade = n > numCampos ? campos[numCampos] : "";
+    size_t len = strlen(identidade);
+    if(len && (len != TAM_IDENTIDADE || strspn(identidade, "0123456789abcdef") != len)) {
+        return "identidade invalida (esperados 16 digitos hexadecimais)";
+    }
+    memcpy(u->identidade, identidade, len + 1);
+    return NULL;
+}
+
+// Valida os campos de um voluntário e preenche u (sem o inserir)
+const char* leVoluntario(User *u, char **campos, int n) {
+    if(n != 11 && n != 12) return "voluntario requer 11 ou 12 campos";
+    if(strcmp(campos[5], "0") != 0 && strcmp(campos[5], "1") != 0) {
+        return "estudante deve ser 0 ou 1";
+    }
+    u->userType = VOLUNTARIO;
+
+    Engineer *e = &u->engineerData;
+    char *destinos[] = { e->nomeCompleto, e->oeNumber, e->especialidade, e->instituicao,
+                         e->areasExpertise, e->email, e->telefone, e->login, e->senha };
+    char *origens[]  = { campos[1], campos[2], campos[3], campos[4],
+                         campos[6], campos[7], campos[8], campos[9], campos[10] };
+
+    if(!copiaCampos(destinos, origens, 9)) return "campo com mais de 99 caracteres";
+    if(!e->nomeCompleto[0] || !e->login[0] || !e->senha[0]) return "nome, login e senha sao obrigatorios";
+    if(!strchr(e->email, '@')) return "email invalido";
+    e->aindaEstudante = campos[5][0] == '1';
+    return leIdentidade(u, campos, n, 11);
+}
+
+// Valida os campos de uma associação e preenche u (sem o inserir)
+const char* leAssociacao(User *u, char **campos, int n) {
+    if(n != 9 && n != 10) return "associacao requer 9 ou 10 campos";
+    u->userType = ASSOCIACAO;
+
+    Association *a = &u->assocData;
+    char *destinos[] = { a->nomeOrganizacao, a->nif, a->email, a->endereco,
+                         a->descricaoAtividades, a->telefone, a->login, a->senha };
+
+    if(!copiaCampos(destinos, campos + 1, 8)) return "campo com mais de 99 caracteres";
+    if(!a->nomeOrganizacao[0] || !a->login[0] || !a->senha[0]) return "organizacao, login e senha sao obrigatorios";
+    if(!strchr(a->email, '@')) return "email invalido";
+    return leIdentidade(u, campos, n, 9);
+}
+
+// Valida os campos de um desafio e preenche c (sem o inserir)
+const char* leDesafio(Challenge *c, char **campos, int n) {
+    if(n != 5 && n != 6) return "desafio requer 5 ou 6 campos";
+
+    char *fim;
+    long horas = strtol(campos[4], &fim, 10);
+    if(!campos[4][0] || *fim || horas < 0 || horas > 1000000) return "horas invalidas";
+
+    char *destinos[] = { c->nomeDesafio, c->descricao, c->tipoEngenheiro, c->associacao };
+    char *origens[]  = { campos[1], campos[2], campos[3], n == 6 ? campos[5] : "" };
+    if(!copiaCampos(destinos, origens, 4)) return "campo com mais de 99 caracteres";
+    if(!c->nomeDesafio[0]) return "nome do desafio e obrigatorio";
+    c->horasEstimadas = (int)horas;
+    return NULL;
+}
+
+const char* importaUsuario(char **campos, int n) {
+    User *u = (User*)calloc(1, sizeof(User));
+    if(!u) return "sem memoria";
+
+    const char *erro = campos[0][0] == 'V' ? leVoluntario(u, campos, n) : leAssociacao(u, campos, n);
+    char *senha = u->userType == VOLUNTARIO ? u->engineerData.senha : u->assocData.senha;
+    // No primário a identidade já vem no registo (ver carimbaRegisto); só
+    // os ficheiros do arranque (-i) podem não a trazer
+    if(!erro && !u->identidade[0] && !novaIdentidade(u->identidade)) erro = "falha ao gerar a identidade";
+    if(!erro) {
+        if(encontraUsuarioPorLogin(loginUsuario(u))) erro = "login duplicado";
+        else if(!protegeSenha(senha)) erro = "falha no hash da senha";
+        else if(!insereUsuario(u)) erro = "limite de usuarios atingido";
+    }
+
+    if(erro) free(u);
+    return erro;
+}
+
+const char* importaDesafio(char **campos, int n) {
+    Challenge *c = (Challenge*)calloc(1, sizeof(Challenge));
+    if(!c) return "sem memoria";
+
+    const char *erro = leDesafio(c, campos, n);
+    if(!erro) {
+        if(encontraDesafio(c->nomeDesafio)) erro = "desafio duplicado";
+        else if(!insereDesafio(c)) erro = "limite de desafios atingido";
+    }
+
+    if(erro) free(c);
+    return erro;
+}
+
+// Valida e insere um registo; devolve NULL em caso de sucesso ou a descrição do erro
+const char* importaLinha(char *linha) {
+    char *campos[MAX_CAMPOS];
+    int n = divideCampos(linha, campos);
+
+    if(n > MAX_CAMPOS) return "campos a mais";
+    if(strcmp(campos[0], "V") == 0 || strcmp(campos[0], "A") == 0) return importaUsuario(campos, n);
+    if(strcmp(campos[0], "D") == 0) return importaDesafio(campos, n);
+    return "tipo de registo desconhecido (esperado V, A ou D)";
+}
+
+// Mensagem de erro que inclui parte da linha (uma por thread)
+static __thread char erroJson[MAX_STR + 64];
+
+// Lê uma string JSON (p aponta para a aspa inicial) para destino e deixa
+// p depois da aspa final. Os escapes \uXXXX são convertidos para UTF-8.
+const char* leStringJson(const char **p, char *destino, size_t tamanho) {
+    const char *s = *p + 1;
+    size_t n = 0;
+
+    while(*s != '"') {
+        unsigned int ch = (unsigned char)*s++;
+        int escapeUnicode = 0;
+        if(!ch) return "string JSON por terminar";
+        if(ch < 0x20) return "caracter de controlo numa string JSON";
+
+        if(ch == '\\') {
+            char esc = *s++;
+            switch(esc) {
+                case '"': case '\\': case '/': ch = (unsigned char)esc; break;
+                case 'b': ch = '\b'; break;
+                case 'f': ch = '\f'; break;
+                case 'n': ch = '\n'; break;
+                case 'r': ch = '\r'; break;
+                case 't': ch = '\t'; break;
+                case 'u': {
+                    char hex[5] = { 0 };
+                    memcpy(hex, s, strnlen(s, 4));
+                    if(strspn(hex, "0123456789abcdefABCDEF") != 4) return "escape \\u invalido";
+                    ch = (unsigned int)strtoul(hex, NULL, 16);
+                    if(ch >= 0xD800 && ch <= 0xDFFF) return "pares substitutos \\u nao suportados";
+                    if(ch == 0) return "caracter nulo numa string JSON";
+                    s += 4;
+                    escapeUnicode = 1;
+                    break;
+                }
+                default: return "escape invalido numa string JSON";
+            }
+        }
+
+        char utf8[3];
+        size_t len = 0;
+        if(!escapeUnicode || ch < 0x80) {
+            utf8[len++] = (char)ch;
+        } else if(ch < 0x800) {
+            utf8[len++] = (char)(0xC0 | (ch >> 6));
+            utf8[len++] = (char)(0x80 | (ch & 0x3F));
+        } else {
+            utf8[len++] = (char)(0xE0 | (ch >> 12));
+            utf8[len++] = (char)(0x80 | ((ch >> 6) & 0x3F));
+            utf8[len++] = (char)(0x80 | (ch & 0x3F));
+        }
+        if(n + len >= tamanho) return "campo com mais de 99 caracteres";
+        memcpy(destino + n, utf8, len);
+        n += len;
+    }
+
+    destino[n] = 0;
+    *p = s + 1;
+    return NULL;
+}
+
+// Lê um valor JSON como texto: strings tal como estão, números pelo seu
+// texto e true/false como "1"/"0", que é como o CSV os escreve
+const char* leValorJson(const char **p, char *destino, size_t tamanho) {
+    if(**p == '"') return leStringJson(p, destino, tamanho);
+    if(strncmp(*p, "true", 4) == 0 || strncmp(*p, "false", 5) == 0) {
+        int verdadeiro = **p == 't';
+        snprintf(destino, tamanho, "%s", verdadeiro ? "1" : "0");
+        *p += verdadeiro ? 4 : 5;
+        return NULL;
+    }
+
+    size_t len = strspn(*p, "-+.0123456789eE");
+    if(!len) return "valor JSON invalido (esperada string, numero, true ou false)";
+    if(len >= tamanho) return "campo com mais de 99 caracteres";
+    memcpy(destino, *p, len);
+    destino[len] = 0;
+    *p += len;
+    return NULL;
+}
+
+#define MAX_CHAVES_JSON (MAX_CAMPOS + 1) // as do tipo mais "tipo"
+
+// Converte um objeto NDJSON na linha CSV equivalente. As chaves podem vir
+// por qualquer ordem e as que faltam ficam vazias (a validação do registo
+// decide se são obrigatórias); chaves desconhecidas ou repetidas e valores
+// com ';' ou quebras de linha são recusados.
+const char* jsonParaCsv(const char *json, char *linha, size_t tamanho) {
+    char chaves[MAX_CHAVES_JSON][MAX_STR];
+    char valores[MAX_CHAVES_JSON][MAX_STR];
+    const char *p = json + strspn(json, ESPACOS_JSON);
+    const char *erro;
+    int n = 0;
+
+    if(*p++ != '{') return "objeto JSON invalido";
+    p += strspn(p, ESPACOS_JSON);
+    while(*p != '}') {
+        if(n == MAX_CHAVES_JSON) return "chaves a mais";
+        if(*p != '"') return "esperada uma chave JSON";
+        if((erro = leStringJson(&p, chaves[n], MAX_STR)) != NULL) return erro;
+        p += strspn(p, ESPACOS_JSON);
+        if(*p++ != ':') return "esperado ':' depois da chave";
+        p += strspn(p, ESPACOS_JSON);
+        if((erro = leValorJson(&p, valores[n], MAX_STR)) != NULL) return erro;
+        n++;
+        p += strspn(p, ESPACOS_JSON);
+        if(*p == ',') {
+            p++;
+            p += strspn(p, ESPACOS_JSON);
+        } else if(*p != '}') {
+            return "esperado ',' ou '}'";
+        }
+    }
+    p++;
+    if(p[strspn(p, ESPACOS_JSON)]) return "texto depois do objeto JSON";
+
+    const char *tipo = NULL;
+    for(int i = 0; i < n; i++) {
+        if(strcmp(chaves[i], "tipo") != 0) continue;
+        if(tipo) return "chave repetida: tipo";
+        tipo = valores[i];
+    }
+    const FormatoRegisto *f = tipo && strlen(tipo) == 1 ? formatoRegisto(tipo[0]) : NULL;
+    if(!f) return "tipo de registo desconhecido (esperado V, A ou D)";
+
+    const char *campos[MAX_CAMPOS] = { NULL };
+    int numCampos = 0;
+    while(numCampos < MAX_CAMPOS && f->chaves[numCampos]) numCampos++;
+
+    for(int i = 0; i < n; i++) {
+        if(valores[i] == tipo) continue;
+        int k = 0;
+        while(k < numCampos && strcmp(f->chaves[k], chaves[i]) != 0) k++;
+        if(k == numCampos) {
+            snprintf(erroJson, sizeof(erroJson), "chave desconhecida para %c: %s", f->tipo, chaves[i]);
+            return erroJson;
+        }
+        if(campos[k]) {
+            snprintf(erroJson, sizeof(erroJson), "chave repetida: %s", chaves[i]);
+            return erroJson;
+        }
+        if(strpbrk(valores[i], ";\n\r")) {
+            snprintf(erroJson, sizeof(erroJson), "valor de %s com ';' ou quebra de linha", chaves[i]);
+            return erroJson;
+        }
+        campos[k] = valores[i];
+    }
+
+    size_t usado = (size_t)snprintf(linha, tamanho, "%c", f->tipo);
+    for(int k = 0; k < numCampos && usado < tamanho; k++) {
+        usado += (size_t)snprintf(linha + usado, tamanho - usado, ";%s", campos[k] ? campos[k] : "");
+    }
+    return usado < tamanho ? NULL : "linha demasiado longa";
+}
+
+typedef struct BlocoImportacao BlocoImportacao;
+
+// Aplica as linhas do bloco (já com os hashes) e reporta as recusadas
+typedef void (*AplicaBloco)(BlocoImportacao *bloco);
+
+struct BlocoImportacao {
+    char (*linhas)[MAX_LINHA_IMPORTACAO];
+    long *numeros;      // número da linha na origem, para os erros
+    int quantidade;
+    int proxima;        // próxima linha a hashear (atómico)
+    int maxThreads;     // threads de hash por bloco
+    AplicaBloco aplica;
+    const char *prefixo; // antes do número da linha nos erros
+    Texto relatorio;    // uma linha por registo recusado
+    long importados;
+    long erros;
+};
+
+// Prepara um bloco vazio; devolve 0 sem memória
+int iniciaBloco(BlocoImportacao *bloco, int maxThreads, AplicaBloco aplica, const char *prefixo) {
+    memset(bloco, 0, sizeof(*bloco));
+    bloco->linhas = malloc(BLOCO_IMPORTACAO * sizeof(*bloco->linhas));
+    bloco->numeros = (long*)malloc(BLOCO_IMPORTACAO * sizeof(long));
+    bloco->maxThreads = maxThreads;
+    bloco->aplica = aplica;
+    bloco->prefixo = prefixo;
+    if(bloco->linhas && bloco->numeros) return 1;
+
+    free(bloco->linhas);
+    free(bloco->numeros);
+    return 0;
+}
+
+void libertaBloco(BlocoImportacao *bloco) {
+    free(bloco->linhas);
+    free(bloco->numeros);
+    textoLiberta(&bloco->relatorio);
+}
+
+void erroImportacao(BlocoImportacao *bloco, long numero, const char *erro) {
+    textoAcrescenta(&bloco->relatorio, "%s%ld: %s\n", bloco->prefixo, numero, erro);
+    bloco->erros++;
+}
+
+// Acrescenta ao bloco uma linha CSV ou NDJSON (sem o '\n'). As vazias e os
+// comentários são ignorados e as que não são V, A ou D vão logo para o
+// relatório. Devolve 1 se o bloco ficou cheio.
+int acrescentaAoBloco(BlocoImportacao *bloco, const char *linha, long numero) {
+    linha += strspn(linha, ESPACOS_JSON);
+    if(!linha[0] || linha[0] == '#') return 0;
+
+    char *destino = bloco->linhas[bloco->quantidade];
+    const char *erro = NULL;
+    if(linha[0] == '{') {
+        erro = jsonParaCsv(linha, destino, MAX_LINHA_IMPORTACAO);
+    } else if(strlen(linha) >= MAX_LINHA_IMPORTACAO) {
+        erro = "linha demasiado longa";
+    } else {
+        strcpy(destino, linha);
+    }
+    if(!erro && (!formatoRegisto(destino[0]) || destino[1] != SEP_CAMPOS)) {
+        erro = "tipo de registo desconhecido (esperado V, A ou D)";
+    }
+
+    if(erro) {
+        erroImportacao(bloco, numero, erro);
+        return 0;
+    }
+    bloco->numeros[bloco->quantidade++] = numero;
+    return bloco->quantidade == BLOCO_IMPORTACAO;
+}
+
+// Campos antes da senha numa linha V ou A: a senha é o último, a não ser
+// que a siga a identidade
+#define CAMPOS_ANTES_SENHA(tipo) ((tipo) == 'V' ? 10 : 8)
+
+// Início do campo da senha de uma linha V ou A, ou NULL se não for uma
+// delas ou tiver campos a menos
+char* campoSenha(char *linha) {
+    if((linha[0] != 'V' && linha[0] != 'A') || linha[1] != SEP_CAMPOS) return NULL;
+    char *p = linha;
+    for(int i = 0; p && i < CAMPOS_ANTES_SENHA(linha[0]); i++) {
+        p = strchr(p, SEP_CAMPOS);
+        if(p) p++;
+    }
+    return p;
+}
+
+// Substitui a senha em texto simples de uma linha V ou A pelo seu hash. Se
+// não for possível a linha fica como está e a validação trata dela.
+void hasheiaLinha(char *linha, struct crypt_data *dados) {
+    char *senha = campoSenha(linha);
+    if(!senha) return;
+    char *resto = strchr(senha, SEP_CAMPOS); // identidade, se vier
+    size_t lenSenha = resto ? (size_t)(resto - senha) : strlen(senha);
+    if(!resto) resto = senha + lenSenha;
+    if(!lenSenha || lenSenha >= MAX_STR ||
+       strncmp(senha, PREFIXO_HASH, strlen(PREFIXO_HASH)) == 0) return;
+
+    char texto[MAX_STR], salt[CRYPT_GENSALT_OUTPUT_SIZE];
+    char hash[CRYPT_OUTPUT_SIZE];
+    memcpy(texto, senha, lenSenha);
+    texto[lenSenha] = 0;
+    if(!crypt_gensalt_rn(PREFIXO_HASH, CUSTO_YESCRYPT, NULL, 0, salt, sizeof(salt))) return;
+    aplicaCrypt(texto, salt, dados, hash);
+
+    size_t len = strlen(hash), lenResto = strlen(resto);
+    if(!len || len >= MAX_STR || (size_t)(senha - linha) + len + lenResto >= MAX_LINHA_IMPORTACAO) return;
+    memmove(senha + len, resto, lenResto + 1);
+    memcpy(senha, hash, len);
+}
+
+void* trabalhadorImportacao(void *arg) {
+    BlocoImportacao *bloco = (BlocoImportacao*)arg;
+    struct crypt_data *dados = (struct crypt_data*)calloc(1, sizeof(struct crypt_data));
+    if(!dados) return NULL;
+
+    int i;
+    while((i = __atomic_fetch_add(&bloco->proxima, 1, __ATOMIC_RELAXED)) < bloco->quantidade) {
+        hasheiaLinha(bloco->linhas[i], dados);
+    }
+    free(dados);
+    return NULL;
+}
+
+// Calcula os hashes do bloco em paralelo (até bloco->maxThreads threads)
+void hasheiaBloco(BlocoImportacao *bloco) {
+    pthread_t threads[MAX_THREADS_IMPORTACAO];
+    int numThreads = bloco->maxThreads;
+    if(numThreads > bloco->quantidade) numThreads = bloco->quantidade;
+
+    bloco->proxima = 0;
+    int criadas = 0;
+    while(criadas < numThreads &&
+          pthread_create(&threads[criadas], NULL, trabalhadorImportacao, bloco) == 0) {
+        criadas++;
+    }
+    if(criadas == 0) trabalhadorImportacao(bloco);
+    for(int i = 0; i < criadas; i++) pthread_join(threads[i], NULL);
+}
+
+// Hasheia e aplica o bloco, que fica vazio; os erros ficam no relatório
+void processaBloco(BlocoImportacao *bloco) {
+    if(bloco->quantidade == 0) return;
+    hasheiaBloco(bloco);
+    bloco->aplica(bloco);
+    bloco->quantidade = 0;
+}
+
+// Inserção direta, para a importação do arranque: ainda não há réplicas
+// nem outras threads a usar os dados
+void aplicaBlocoArranque(BlocoImportacao *bloco) {
+    for(int i = 0; i < bloco->quantidade; i++) {
+        const char *erro = memoriaEsgotada() ? "limite de memoria do servidor atingido"
+                                             : importaLinha(bloco->linhas[i]);
+        if(erro) erroImportacao(bloco, bloco->numeros[i], erro);
+        else bloco->importados++;
+    }
+}
+
+// Uma thread por CPU, até MAX_THREADS_IMPORTACAO
+int threadsPorCpu(void) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    return cpus < 1 ? 1 : cpus > MAX_THREADS_IMPORTACAO ? MAX_THREADS_IMPORTACAO : (int)cpus;
+}
+
+// Carrega um ficheiro de importação no arranque. Os erros são reportados
+// por linha em stderr e não interrompem a carga das restantes linhas.
+int importaFicheiro(const char *caminho) {
+    FILE *f = fopen(caminho, "r");
+    if(!f) {
+        perror("Erro ao abrir ficheiro de importacao");
+        return 0;
+    }
+    setvbuf(f, NULL, _IOFBF, 1 << 20);
+
+    char prefixo[1024];
+    snprintf(prefixo, sizeof(prefixo), "%s:", caminho);
+
+    BlocoImportacao bloco;
+    if(!iniciaBloco(&bloco, threadsPorCpu(), aplicaBlocoArranque, prefixo)) {
+        fprintf(stderr, "Sem memoria para importar %s\n", caminho);
+        fclose(f);
+        return 0;
+    }
+
+    char linha[MAX_LINHA_IMPORTACAO];
+    long numLinha = 0;
+    int fim = 0;
+
+    while(!fim) {
+        fim = !fgets(linha, sizeof(linha), f);
+        if(!fim) {
+            numLinha++;
+            if(!strchr(linha, '\n') && !feof(f)) {
+                int ch;
+                while((ch = fgetc(f)) != EOF && ch != '\n');
+                erroImportacao(&bloco, numLinha, "linha demasiado longa");
+                continue;
+            }
+            removeNewline(linha);
+            if(!acrescentaAoBloco(&bloco, linha, numLinha)) continue;
+        }
+        processaBloco(&bloco);
+        if(bloco.relatorio.usado) fputs(bloco.relatorio.dados, stderr);
+        bloco.relatorio.usado = 0;
+    }
+
+    printf("Importacao de %s: %ld registos importados, %ld com erro.\n",
+           caminho, bloco.importados, bloco.erros);
+    libertaBloco(&bloco);
+    fclose(f);
+    return 1;
+}
+
+// Escreve um campo seguido de ';' (ou '\n' se for o último). Os separadores
+// dentro do texto são trocados por ',' para não partir o registo.
+void textoCampo(Texto *t, const char *texto, int ultimo) {
+    size_t len = strlen(texto);
+    if(!textoReserva(t, len + 1)) return;
+
+    for(size_t i = 0; i < len; i++) {
+        char ch = texto[i];
+        t->dados[t->usado++] = (ch == SEP_CAMPOS || ch == '\n' || ch == '\r') ? ',' : ch;
+    }
+    t->dados[t->usado++] = ultimo ? '\n' : SEP_CAMPOS;
+    t->dados[t->usado] = 0;
+}
+
+// Escreve o texto como string JSON, entre aspas e com os escapes necessários
+void textoJson(Texto *t, const char *texto) {
+    size_t len = strlen(texto);
+    if(!textoReserva(t, len * 6 + 2)) return;
+
+    t->dados[t->usado++] = '"';
+    for(size_t i = 0; i < len; i++) {
+        unsigned char ch = (unsigned char)texto[i];
+        if(ch == '"' || ch == '\\') {
+            t->dados[t->usado++] = '\\';
+            t->dados[t->usado++] = (char)ch;
+        } else if(ch < 0x20) {
+            t->usado += sprintf(t->dados + t->usado, "\\u%04x", ch);
+        } else {
+            t->dados[t->usado++] = (char)ch;
+        }
+    }
+    t->dados[t->usado++] = '"';
+    t->dados[t->usado] = 0;
+}
+
+// Escreve um registo como linha CSV ou, com json, como objeto NDJSON; os
+// valores vêm pela ordem das chaves do formato
+void textoRegisto(Texto *t, const FormatoRegisto *f, const char **valores, int json) {
+    char tipo[2] = { f->tipo, 0 };
+
+    if(!json) {
+        textoCampo(t, tipo, 0);
+        for(int k = 0; k < MAX_CAMPOS && f->chaves[k]; k++) {
+            textoCampo(t, valores[k], k + 1 == MAX_CAMPOS || !f->chaves[k + 1]);
+        }
+        return;
+    }
+
+    textoAcrescenta(t, "{\"tipo\":\"%s\"", tipo);
+    for(int k = 0; k < MAX_CAMPOS && f->chaves[k]; k++) {
+        textoAcrescenta(t, ",\"%s\":", f->chaves[k]);
+        if(strcmp(f->chaves[k], "estudante") == 0) {
+            textoAcrescenta(t, "%s", valores[k][0] == '1' ? "true" : "false");
+        } else if(strcmp(f->chaves[k], "horas") == 0) {
+            textoAcrescenta(t, "%s", valores[k]);
+        } else {
+            textoJson(t, valores[k]);
+        }
+    }
+    textoAcrescenta(t, "}\n");
+}
+
+// Valores de um usuário pela ordem de formatosRegisto; devolve o formato,
+// ou NULL para o administrador, que não é serializado
+const FormatoRegisto* valoresUsuario(const User *u, const char *valores[MAX_CAMPOS]) {
+    if(u->userType == VOLUNTARIO) {
+        const Engineer *e = &u->engineerData;
+        const char *v[] = { e->nomeCompleto, e->oeNumber, e->especialidade, e->instituicao,
+                            e->aindaEstudante ? "1" : "0", e->areasExpertise, e->email,
+                            e->telefone, e->login, e->senha, u->identidade };
+        memcpy(valores, v, sizeof(v));
+        return formatoRegisto('V');
+    }
+    if(u->userType == ASSOCIACAO) {
+        const Association *a = &u->assocData;
+        const char *v[] = { a->nomeOrganizacao, a->nif, a->email, a->endereco,
+                            a->descricaoAtividades, a->telefone, a->login, a->senha, u->identidade };
+        memcpy(valores, v, sizeof(v));
+        return formatoRegisto('A');
+    }
+    return NULL;
+}
+
+const FormatoRegisto* valoresDesafio(const Challenge *c, const char *valores[MAX_CAMPOS], char horas[16]) {
+    snprintf(horas, 16, "%d", c->horasEstimadas);
+    const char *v[] = { c->nomeDesafio, c->descricao, c->tipoEngenheiro, horas, c->associacao };
+    memcpy(valores, v, sizeof(v));
+    return formatoRegisto('D');
+}
+
+// Linha V ou A do usuário (o administrador não é serializado)
+void serializaUsuario(Texto *t, const User *u) {
+    const char *valores[MAX_CAMPOS];
+    const FormatoRegisto *f = valoresUsuario(u, valores);
+    if(f) textoRegisto(t, f, valores, 0);
+}
+
+void serializaDesafio(Texto *t, const Challenge *c) {
+    const char *valores[MAX_CAMPOS];
+    char horas[16];
+    textoRegisto(t, valoresDesafio(c, valores, horas), valores, 0);
+}
+
+// Exporta todos os voluntários, associações e desafios no formato de importação
+// (CSV, ou NDJSON com json). O texto é enviado em blocos de
+// TAM_BLOCO_EXPORTACAO, não um send por registo.
+// Percorre as tabelas de handles por índice de slot, que não muda com as
+// remoções, e larga o mutex durante cada envio: um administrador lento não
+// bloqueia o servidor. Registos alterados durante a exportação podem ou não
+// aparecer, mas cada linha é consistente.
+void exportaDados(int sockfd, int json) {
+    Texto t = { NULL, 0, 0, 0, 0 };
+    const char *valores[MAX_CAMPOS];
+    char horas[16];
+
+    pthread_mutex_lock(&mutexDados);
+    for(uint32_t i = 0; i < tabelaUsuarios.usados; i++) {
+        const User *u = (const User*)tabelaUsuarios.slots[i].registo;
+        const FormatoRegisto *f = u ? valoresUsuario(u, valores) : NULL;
+        if(f) textoRegisto(&t, f, valores, json);
+        if(t.usado >= TAM_BLOCO_EXPORTACAO) {
+            pthread_mutex_unlock(&mutexDados);
+            textoDespeja(sockfd, &t);
+            pthread_mutex_lock(&mutexDados);
+        }
+    }
+
+    for(uint32_t i = 0; i < tabelaDesafios.usados; i++) {
+        const Challenge *c = (const Challenge*)tabelaDesafios.slots[i].registo;
+        if(c) textoRegisto(&t, valoresDesafio(c, valores, horas), valores, json);
+        if(t.usado >= TAM_BLOCO_EXPORTACAO) {
+            pthread_mutex_unlock(&mutexDados);
+            textoDespeja(sockfd, &t);
+            pthread_mutex_lock(&mutexDados);
+        }
+    }
+    pthread_mutex_unlock(&mutexDados);
+
+    textoCampo(&t, "# fim da exportacao", 1);
+    textoEnvia(sockfd, &t);
+}
+
+// --------------------------------------------------
+// Aceitação de conexões
+// --------------------------------------------------
+// Os sockets de escuta são não bloqueantes porque podem ser partilhados com
+// outro processo durante um reinício: o accept espera em poll, junto com o
+// pipe de paragem. Escrever em pipeParagem termina todos os ciclos de accept.
+
+#define ACEITE_PARAGEM -1
+#define ACEITE_ERRO    -2
+
+int pipeParagem[2] = { -1, -1 };
+
+// Conexões de clientes em curso, para as drenar antes de o processo sair
+int conexoesAtivas = 0;
+pthread_mutex_t mutexConexoes = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t conexoesMudaram = PTHREAD_COND_INITIALIZER;
+
+// Espera por uma conexão; devolve o socket, ACEITE_PARAGEM ou ACEITE_ERRO
+int aceitaConexao(int sockfd, struct sockaddr_in *endereco) {
+    struct pollfd espera[2] = { { sockfd, POLLIN, 0 }, { pipeParagem[0], POLLIN, 0 } };
+
+    while(1) {
+        if(poll(espera, 2, -1) < 0) {
+            if(errno == EINTR) continue;
+            return ACEITE_ERRO;
+        }
+        if(espera[1].revents) return ACEITE_PARAGEM;
+
+        socklen_t len = sizeof(*endereco);
+        int fd = accept(sockfd, (struct sockaddr*)endereco, &len);
+        if(fd >= 0) return fd;
+        // O outro processo que partilha o socket pode ter ficado com a conexão
+        if(errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) return ACEITE_ERRO;
+    }
+}
+
+// --------------------------------------------------
+// Controlo de admissão
+// --------------------------------------------------
+// Cada IP de origem tem um balde de fichas por ação limitada (ligar, fazer
+// login, cadastrar-se, candidatar-se): o balde enche à taxa da ação até à
+// rajada permitida e cada pedido gasta uma ficha. A admissão de uma conexão
+// é decidida no ciclo de accept, antes de criar a thread ou qualquer estado
+// da sessão; a recusa é uma linha enviada sem bloquear seguida do fecho.
+// Há ainda um teto global de conexões e um teto por IP. Sob pressão (perto
+// do teto global ou com a fila do listen a encher) só entra a primeira
+// conexão de cada IP, para que quem abre muitas não afaste os restantes.
+
+typedef enum {
+    ACAO_CONEXAO,
+    ACAO_LOGIN,
+    ACAO_CADASTRO,
+    ACAO_CANDIDATURA,
+    NUM_ACOES
+} AcaoLimitada;
+
+typedef struct LimiteAcao {
+    double taxa;   // fichas repostas por segundo
+    double rajada; // capacidade do balde
+} LimiteAcao;
+
+const LimiteAcao limitesAcoes[NUM_ACOES] = {
+    { 5.0, 20.0 }, // conexões
+    { 1.0, 5.0 },  // logins (cada um custa um hash yescrypt)
+    { 0.2, 3.0 },  // cadastros
+    { 1.0, 10.0 }, // candidaturas
+};
+
+#define MAX_CONEXOES          1024
+#define LIMIAR_PRESSAO        (MAX_CONEXOES * 3 / 4)
+#define MAX_CONEXOES_POR_IP   16
+#define BALDES_ADMISSAO       4096
+#define MAX_CLIENTES_ADMISSAO 65536
+
+typedef struct ClienteAdmissao {
+    uint32_t ip;
+    int conexoes;                // conexões admitidas ainda abertas
+    double fichas[NUM_ACOES];
+    double atualizado;           // instante da última reposição das fichas
+    struct ClienteAdmissao *next;
+} ClienteAdmissao;
+
+typedef struct TabelaAdmissao {
+    pthread_mutex_t mutex;
+    ClienteAdmissao *baldes[BALDES_ADMISSAO];
+    int numClientes;
+} TabelaAdmissao;
+
+TabelaAdmissao tabelaAdmissao = { PTHREAD_MUTEX_INITIALIZER, { NULL }, 0 };
+
+// IP da conexão atendida pela thread, para os limites por ação
+static __thread uint32_t ipCliente;
+
+double agoraMonotonico(void) {
+    struct timespec t;
+    clock_gettime(CLOCK_MONOTONIC, &t);
+    return t.tv_sec + t.tv_nsec / 1e9;
+}
+
+ClienteAdmissao** baldeAdmissao(uint32_t ip) {
+    return &tabelaAdmissao.baldes[(ip * 2654435761u) % BALDES_ADMISSAO];
+}
+
+// Repõe as fichas pelo tempo decorrido (tabela trancada)
+void repoeFichas(ClienteAdmissao *c, double agora) {
+    double decorrido = agora - c->atualizado;
+    for(int a = 0; a < NUM_ACOES; a++) {
+        c->fichas[a] += decorrido * limitesAcoes[a].taxa;
+        if(c->fichas[a] > limitesAcoes[a].rajada) c->fichas[a] = limitesAcoes[a].rajada;
+    }
+    c->atualizado = agora;
+}
+
+// Esquece os IPs sem conexões e com os baldes já cheios (tabela trancada)
+void esqueceClientesInativos(double agora) {
+    for(int b = 0; b < BALDES_ADMISSAO; b++) {
+        ClienteAdmissao **pp = &tabelaAdmissao.baldes[b];
+        while(*pp) {
+            ClienteAdmissao *c = *pp;
+            int cheio = c->conexoes == 0;
+            repoeFichas(c, agora);
+            for(int a = 0; cheio && a < NUM_ACOES; a++) {
+                cheio = c->fichas[a] >= limitesAcoes[a].rajada;
+            }
+            if(cheio) {
+                *pp = c->next;
+                free(c);
+                tabelaAdmissao.numClientes--;
+                contaMemoria(MEM_ADMISSAO, -(long long)sizeof(ClienteAdmissao));
+            } else {
+                pp = &c->next;
+            }
+        }
+    }
+}
+
+// Devolve o cliente do IP com as fichas repostas, criando-o com os baldes
+// cheios; NULL se a tabela estiver cheia (tabela trancada)
+ClienteAdmissao* clienteAdmissao(uint32_t ip, double agora) {
+    ClienteAdmissao **balde = baldeAdmissao(ip);
+    for(ClienteAdmissao *c = *balde; c; c = c->next) {
+        if(c->ip == ip) {
+            repoeFichas(c, agora);
+            return c;
+        }
+    }
+
+    if(tabelaAdmissao.numClientes >= MAX_CLIENTES_ADMISSAO) {
+        esqueceClientesInativos(agora);
+        if(tabelaAdmissao.numClientes >= MAX_CLIENTES_ADMISSAO) return NULL;
+    }
+
+    ClienteAdmissao *c = (ClienteAdmissao*)calloc(1, sizeof(ClienteAdmissao));
+    if(!c) return NULL;
+    c->ip = ip;
+    for(int a = 0; a < NUM_ACOES; a++) c->fichas[a] = limitesAcoes[a].rajada;
+    c->atualizado = agora;
+    c->next = *balde;
+    *balde = c;
+    tabelaAdmissao.numClientes++;
+    contaMemoria(MEM_ADMISSAO, sizeof(ClienteAdmissao));
+    return c;
+}
+
+int gastaFicha(ClienteAdmissao *c, AcaoLimitada acao) {
+    if(c->fichas[acao] < 1.0) return 0;
+    c->fichas[acao] -= 1.0;
+    return 1;
+}
+
+// Ocupação da fila do listen em percentagem (Linux: no socket de escuta o
+// TCP_INFO dá o tamanho atual e o máximo da fila de aceitação)
+int ocupacaoFilaListen(int sockfd) {
+    struct tcp_info info;
+    socklen_t len = sizeof(info);
+    if(getsockopt(sockfd, IPPROTO_TCP, TCP_INFO, &info, &len) < 0 || info.tcpi_sacked == 0) return 0;
+    return (int)(100 * info.tcpi_unacked / info.tcpi_sacked);
+}
+
+// Decide se a conexão acabada de aceitar é atendida: devolve NULL ou a
+// mensagem de recusa. Se for admitida, conta para o IP até libertaConexao.
+const char* admiteConexao(int sockEscuta, uint32_t ip) {
+    pthread_mutex_lock(&mutexConexoes);
+    int ativas = conexoesAtivas;
+    pthread_mutex_unlock(&mutexConexoes);
+
+    if(ativas >= MAX_CONEXOES) return "Servidor cheio; tente mais tarde.\n";
+    int pressao = ativas >= LIMIAR_PRESSAO || ocupacaoFilaListen(sockEscuta) >= 50;
+
+    const char *recusa = NULL;
+    pthread_mutex_lock(&tabelaAdmissao.mutex);
+    ClienteAdmissao *c = clienteAdmissao(ip, agoraMonotonico());
+    if(!c) {
+        recusa = "Servidor ocupado; tente mais tarde.\n";
+    } else if(c->conexoes >= MAX_CONEXOES_POR_IP || (pressao && c->conexoes > 0)) {
+        recusa = "Demasiadas conexoes abertas a partir deste endereco.\n";
+    } else if(!gastaFicha(c, ACAO_CONEXAO)) {
+        recusa = "Demasiadas conexoes seguidas; aguarde um momento.\n";
+    } else {
+        c->conexoes++;
+    }
+    pthread_mutex_unlock(&tabelaAdmissao.mutex);
+    return recusa;
+}
+
+void libertaConexao(uint32_t ip) {
+    pthread_mutex_lock(&tabelaAdmissao.mutex);
+    for(ClienteAdmissao *c = *baldeAdmissao(ip); c; c = c->next) {
+        if(c->ip == ip) {
+            c->conexoes--;
+            break;
+        }
+    }
+    pthread_mutex_unlock(&tabelaAdmissao.mutex);
+}
+
+// Gasta uma ficha da ação para o cliente da thread; 0 se o limite foi atingido
+int permiteAcao(int sockfd, AcaoLimitada acao) {
+    pthread_mutex_lock(&tabelaAdmissao.mutex);
+    ClienteAdmissao *c = clienteAdmissao(ipCliente, agoraMonotonico());
+    int permitido = c && gastaFicha(c, acao);
+    pthread_mutex_unlock(&tabelaAdmissao.mutex);
+
+    if(!permitido) enviaCliente(sockfd, "Demasiados pedidos seguidos; aguarde um momento.\n", 49);
+    return permitido;
+}
+
+// Poupa ao cliente o preenchimento de um formulário que seria recusado
+int aceitaRegistos(int sockfd) {
+    if(!memoriaEsgotada()) return 1;
+    enviaCliente(sockfd, "Servidor sem memoria para novos registos.\n", 42);
+    return 0;
+}
+
+// --------------------------------------------------
+// Replicação primário/réplica
+// --------------------------------------------------
+// Todas as mutações passam por executaMutacao() como uma linha no formato de
+// importação (V, A, D, com a senha já em hash e, nos usuários, a identidade
+// que o primário lhes atribui), estendido com:
+//   C;desafio;loginEngenheiro;loginAssociacao                  (candidatura)
+//   P;desafio;loginEngenheiro;loginAssociacao;status;mensagem  (decisão)
+//   RU;login   e   RD;nomeDesafio                               (remoções)
+// Decisões em lote passam por executaLote() e são aplicadas todas ou nenhuma.
+// No primário (-p <porta>) cada mutação aplicada entra num log circular em
+// memória, que é enviado às réplicas em lotes. Protocolo (uma linha por item):
+//   primário -> réplica:  "S <seq>", registos, "F"        snapshot inicial
+//                         "L <seq> <n>" + n registos      lote do log
+//                         "H <seq>"                       sem novidades
+//                         "R <id> <seq>" / "E <id> <erro>" resposta a "M"/"B"
+//   réplica -> primário:  "K <segredo>"                   primeira linha
+//                         "A <seq>"                       aplicado até seq
+//                         "M <id> <registo>"              mutação encaminhada
+//                         "B <id> <n>" + n registos       lote de decisões
+// A porta de replicação escuta em 127.0.0.1 salvo se for dado um endereço
+// (-p endereco:porta). O snapshot contém os hashes das senhas e os dados
+// pessoais e um "M" altera os dados, por isso primário e réplicas partilham
+// um segredo (-k ficheiro, primeira linha): o primário só envia o snapshot
+// e só começa a ler mutações depois de receber "K" com o segredo certo.
+// Uma réplica (-r host:porta) serve os menus de leitura com os dados locais e
+// encaminha as mutações ao primário, esperando até ver a própria escrita
+// aplicada. Se ficar para trás do log circular ou perder a ligação, volta a
+// ligar-se e recomeça a partir de um snapshot.
+
+#define TAM_LOG_REPLICACAO 65536
+#define ESPERA_PRIMARIO    5 // segundos à espera da resposta a um "M"
+#define MAX_LINHA_PROTOCOLO (MAX_LINHA_IMPORTACAO + 64)
+#define ESPERA_AUTENTICACAO 5 // segundos para a réplica enviar o segredo
+
+typedef enum {
+    SEM_REPLICACAO,
+    PRIMARIO,
+    REPLICA
+} ModoReplicacao;
+
+ModoReplicacao modoReplicacao = SEM_REPLICACAO;
+
+// Log do primário, protegido por mutexDados. A mutação de número seq fica em
+// logMutacoes[seq % TAM_LOG_REPLICACAO] enquanto seq >= logFim - TAM_LOG_REPLICACAO.
+char *logMutacoes[TAM_LOG_REPLICACAO];
+unsigned long long logFim = 0;
+int logAtivo = 0; // só há log se houver quem o siga (réplicas ou um reinício)
+pthread_cond_t novaMutacao = PTHREAD_COND_INITIALIZER;
+
+// Réplica ligada ao primário (lista protegida por mutexDados)
+typedef struct Replica {
+    int sockfd;
+    char endereco[INET_ADDRSTRLEN + 8];
+    unsigned long long confirmado; // último seq que a réplica aplicou
+    int ligada;
+    int autenticada;               // enviou o segredo (ou é o processo anterior)
+    pthread_mutex_t mutexEnvio;    // lotes e respostas partilham o socket
+    struct Replica *next;
+} Replica;
+
+Replica *listaReplicas = NULL;
+int socketReplicacao = -1; // escuta das réplicas (primário)
+char enderecoReplicacao[INET_ADDRSTRLEN] = "127.0.0.1";
+char segredoReplicacao[MAX_STR]; // partilhado por primário e réplicas (-k)
+
+// Mutação encaminhada pela réplica à espera da resposta do primário
+typedef struct PedidoReplica {
+    unsigned long long id;
+    int respondido;
+    unsigned long long seq;
+    char erro[MAX_STR];
+    struct PedidoReplica *next;
+} PedidoReplica;
+
+typedef struct EstadoReplica {
+    char host[MAX_STR];
+    int porta;
+    int sockfd;                      // -1 enquanto desligada
+    unsigned long long aplicado;     // log aplicado localmente
+    unsigned long long seqPrimario;  // último seq anunciado pelo primário
+    unsigned long long proxPedido;
+    PedidoReplica *pedidos;
+    pthread_mutex_t mutex;           // protege o estado e o envio para o primário
+    pthread_cond_t mudou;
+} EstadoReplica;
+
+EstadoReplica estadoReplica = { "", 0, -1, 0, 0, 0, NULL,
+                                PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER };
+
+int enviaTudo(int sockfd, const char *dados, size_t len) {
+    while(len > 0) {
+        ssize_t n = send(sockfd, dados, len, 0);
+        if(n <= 0) return 0;
+        dados += n;
+        len -= n;
+    }
+    return 1;
+}
+
+// Lê n registos (ou até à linha "F" se n == 0) antes de trancar os dados,
+// para que as leituras locais não esperem pela rede
+int recebeRegistos(int sockfd, Texto *t, unsigned long long n) {
+    char linha[MAX_LINHA_PROTOCOLO];
+    t->usado = 0;
+
+    for(unsigned long long i = 0; n == 0 || i < n; i++) {
+        if(recebeLinha(sockfd, linha, sizeof(linha)) < 0) return 0;
+        if(n == 0 && strcmp(linha, "F") == 0) break;
+        textoAcrescenta(t, "%s\n", linha);
+    }
+    return 1;
+}
+
+// Acrescenta a mutação ao log e acorda as réplicas (mutexDados trancado)
+void registaMutacao(const char *linha) {
+    if(!logAtivo) return;
+
+    char **entrada = &logMutacoes[logFim % TAM_LOG_REPLICACAO];
+    if(*entrada) contaMemoria(MEM_LOG, -(long long)(strlen(*entrada) + 1));
+    free(*entrada);
+    *entrada = strdup(linha);
+    if(*entrada) contaMemoria(MEM_LOG, strlen(*entrada) + 1);
+    logFim++;
+    pthread_cond_broadcast(&novaMutacao);
+}
+
+const char* aplicaCandidatura(char **campos, int n) {
+    if(n != 4) return "candidatura requer 4 campos";
+
+    Challenge *desafio = encontraDesafio(campos[1]);
+    User *engenheiro = encontraUsuarioPorLogin(campos[2]);
+    User *associacao = encontraUsuarioPorLogin(campos[3]);
+
+    if(!desafio) return "desafio nao encontrado";
+    if(!engenheiro || engenheiro->userType != VOLUNTARIO) return "voluntario nao encontrado";
+    if(!associacao || associacao->userType != ASSOCIACAO) return "associacao nao encontrada";
+    return insereCandidatura(desafio, engenheiro, associacao) ? NULL : "sem memoria";
+}
+
+const char* aplicaDecisao(char **campos, int n) {
+    if(n != 6) return "decisao requer 6 campos";
+    if(strcmp(campos[4], "1") != 0 && strcmp(campos[4], "2") != 0) return "status deve ser 1 ou 2";
+
+    Challenge *desafio = encontraDesafio(campos[1]);
+    User *engenheiro = encontraUsuarioPorLogin(campos[2]);
+    User *associacao = encontraUsuarioPorLogin(campos[3]);
+    if(!desafio || !engenheiro || !associacao) return "candidatura nao encontrada";
+
+    Application **pp = &listaCandidaturas, *aux;
+    while((aux = candidaturaValida(pp)) != NULL) {
+        if(aux->desafio == desafio->id && aux->engenheiro == engenheiro->id &&
+           aux->associacao == associacao->id && aux->status == 0) {
+            processaCandidatura(aux, campos[4][0] == '1', campos[5]);
+            return NULL;
+        }
+        pp = &aux->next;
+    }
+    return "candidatura nao esta pendente";
+}
+
+void removeAnexos(const char *desafio); // ver "Anexos dos desafios"
+
+// Aplica um registo de mutação aos dados locais (mutexDados trancado)
+const char* aplicaLinha(char *linha) {
+    char *campos[MAX_CAMPOS];
+
+    if(strncmp(linha, "C;", 2) != 0 && strncmp(linha, "P;", 2) != 0 &&
+       strncmp(linha, "RU;", 3) != 0 && strncmp(linha, "RD;", 3) != 0) {
+        // V, A ou D: o hash nunca é calculado aqui, com os dados trancados
+        const char *senha = campoSenha(linha);
+        if((linha[0] == 'V' || linha[0] == 'A') &&
+           (!senha || strncmp(senha, PREFIXO_HASH, strlen(PREFIXO_HASH)) != 0)) {
+            return "senha sem hash";
+        }
+        return importaLinha(linha);
+    }
+
+    int n = divideCampos(linha, campos);
+    if(n > MAX_CAMPOS) return "campos a mais";
+    if(strcmp(campos[0], "C") == 0) return aplicaCandidatura(campos, n);
+    if(strcmp(campos[0], "P") == 0) return aplicaDecisao(campos, n);
+    if(n != 2) return "remocao requer 2 campos";
+
+    if(strcmp(campos[0], "RU") == 0) {
+        User *alvo = encontraUsuarioPorLogin(campos[1]);
+        if(!alvo || alvo->userType == ADMIN) return "usuario nao encontrado";
+        removeUsuario(alvo->id);
+    } else {
+        Challenge *alvo = encontraDesafio(campos[1]);
+        if(!alvo) return "desafio nao encontrado";
+        removeDesafio(alvo->id);
+        // Em cada máquina, para que um desafio recriado com o mesmo nome não
+        // herde os anexos do anterior (são poucos ficheiros: o mutex aguenta)
+        removeAnexos(campos[1]);
+    }
+    return NULL;
+}
+
+// Devolvido por aplicaMutacao quando o processo passou a réplica entretanto
+// (reinício sem interrupção): a mutação tem de ser encaminhada
+const char MUTACAO_ENCAMINHAR[] = "encaminhar";
+
+// Recusa registos novos acima do orçamento global e candidaturas acima do
+// orçamento do voluntário; remoções e decisões passam sempre. Só o primário
+// decide: as réplicas aplicam o log sem verificar (mutexDados trancado).
+const char* verificaOrcamento(const char *linha) {
+    if(strncmp(linha, "RU;", 3) == 0 || strncmp(linha, "RD;", 3) == 0 || strncmp(linha, "P;", 2) == 0) {
+        return NULL;
+    }
+    if(memoriaEsgotada()) return "limite de memoria do servidor atingido";
+    if(strncmp(linha, "C;", 2) != 0) return NULL;
+
+    char copia[MAX_LINHA_IMPORTACAO];
+    char *campos[MAX_CAMPOS];
+    snprintf(copia, sizeof(copia), "%s", linha);
+    int n = divideCampos(copia, campos);
+    User *engenheiro = n >= 3 ? encontraUsuarioPorLogin(campos[2]) : NULL;
+    if(engenheiro && engenheiro->memoria + sizeof(Application) > (size_t)orcamentoUsuario) {
+        return "limite de memoria do usuario atingido";
+    }
+    return NULL;
+}
+
+// Dá uma identidade nova a um registo V ou A que não a traga (cadastro ou
+// importação), antes de ser aplicado e registado: o log e os snapshots
+// levam-na às réplicas, que assim distinguem um usuário recriado com o
+// mesmo login do anterior (ver sincronizaRegisto). Linhas com campos a
+// mais ou a menos ficam como estão para a validação as recusar.
+void carimbaRegisto(char *linha, size_t tamanho) {
+    char *senha = campoSenha(linha);
+    if(!senha) return;
+    char *resto = strchr(senha, SEP_CAMPOS);
+    if(resto && (resto[1] || strchr(resto + 1, SEP_CAMPOS))) return; // já a tem
+
+    char identidade[TAM_IDENTIDADE + 1];
+    size_t len = strlen(linha);
+    if(!novaIdentidade(identidade)) return;
+    if(!resto) {
+        if(len + 1 >= tamanho) return;
+        linha[len++] = SEP_CAMPOS;
+        linha[len] = 0;
+    }
+    snprintf(linha + len, tamanho - len, "%s", identidade);
+}
+
+// Aplica localmente e regista no log; devolve o erro ou NULL
+const char* aplicaMutacao(const char *linha, unsigned long long *seq) {
+    char registo[MAX_LINHA_IMPORTACAO], copia[MAX_LINHA_IMPORTACAO];
+    snprintf(registo, sizeof(registo), "%s", linha);
+    carimbaRegisto(registo, sizeof(registo));
+    memcpy(copia, registo, sizeof(copia));
+
+    pthread_mutex_lock(&mutexDados);
+    if(modoReplicacao == REPLICA) {
+        pthread_mutex_unlock(&mutexDados);
+        return MUTACAO_ENCAMINHAR;
+    }
+    const char *erro = verificaOrcamento(copia);
+    if(!erro) erro = aplicaLinha(copia);
+    if(!erro) registaMutacao(registo);
+    if(seq) *seq = logFim;
+    pthread_mutex_unlock(&mutexDados);
+    return erro;
+}
+
+// Importação pelo menu do administrador: o bloco inteiro é aplicado numa
+// só passagem pelo mutex e cada registo aceite entra no log, como uma
+// mutação isolada. Se o processo passou a réplica entretanto, o bloco é
+// recusado em vez de encaminhado registo a registo.
+void aplicaBlocoMutacoes(BlocoImportacao *bloco) {
+    char copia[MAX_LINHA_IMPORTACAO];
+
+    for(int i = 0; i < bloco->quantidade; i++) carimbaRegisto(bloco->linhas[i], MAX_LINHA_IMPORTACAO);
+    pthread_mutex_lock(&mutexDados);
+    for(int i = 0; i < bloco->quantidade; i++) {
+        const char *linha = bloco->linhas[i];
+        const char *erro = modoReplicacao == REPLICA ? "o servidor deixou de ser o primario" : NULL;
+        memcpy(copia, linha, strlen(linha) + 1);
+
+        if(!erro) erro = verificaOrcamento(copia);
+        if(!erro) erro = aplicaLinha(copia);
+        if(!erro) {
+            registaMutacao(linha);
+            bloco->importados++;
+        } else {
+            erroImportacao(bloco, bloco->numeros[i], erro);
+        }
+    }
+    pthread_mutex_unlock(&mutexDados);
+}
+
+// Decisão de um lote, já resolvida para handles
+typedef struct DecisaoLote {
+    Handle desafio, engenheiro, associacao;
+    int aceitar;
+    const char *mensagem;
+    const char *linha;        // registo original, para o log
+    Application *candidatura; // encontrada na passagem pela lista
+} DecisaoLote;
+
+int comparaDecisoes(const void *a, const void *b) {
+    const DecisaoLote *x = (const DecisaoLote*)a, *y = (const DecisaoLote*)b;
+    if(x->desafio != y->desafio) return x->desafio < y->desafio ? -1 : 1;
+    if(x->engenheiro != y->engenheiro) return x->engenheiro < y->engenheiro ? -1 : 1;
+    if(x->associacao != y->associacao) return x->associacao < y->associacao ? -1 : 1;
+    return 0;
+}
+
+// Resolve as decisões do lote e casa-as com as candidaturas pendentes numa
+// só passagem pela lista, depois de as ordenar (mutexDados trancado)
+const char* preparaLote(char *campos, char *originais, DecisaoLote *decisoes, int n) {
+    char *linha = campos;
+    for(int i = 0; i < n; i++) {
+        char *nl = strchr(linha, '\n');
+        if(nl) {
+            *nl = 0;
+            originais[nl - campos] = 0;
+        }
+        decisoes[i].linha = originais + (linha - campos);
+
+        char *c[MAX_CAMPOS];
+        int num = divideCampos(linha, c);
+        if(num != 6 || strcmp(c[0], "P") != 0) return "o lote so aceita decisoes";
+        if(strcmp(c[4], "1") != 0 && strcmp(c[4], "2") != 0) return "status deve ser 1 ou 2";
+
+        Challenge *desafio = encontraDesafio(c[1]);
+        User *engenheiro = encontraUsuarioPorLogin(c[2]);
+        User *associacao = encontraUsuarioPorLogin(c[3]);
+        if(!desafio || !engenheiro || !associacao) return "candidatura nao encontrada";
+        decisoes[i].desafio = desafio->id;
+        decisoes[i].engenheiro = engenheiro->id;
+        decisoes[i].associacao = associacao->id;
+        decisoes[i].aceitar = c[4][0] == '1';
+        decisoes[i].mensagem = c[5];
+
+        if(nl) linha = nl + 1;
+    }
+
+    qsort(decisoes, n, sizeof(DecisaoLote), comparaDecisoes);
+
+    Application **pp = &listaCandidaturas, *aux;
+    while((aux = candidaturaValida(pp)) != NULL) {
+        if(aux->status == 0) {
+            DecisaoLote chave = { aux->desafio, aux->engenheiro, aux->associacao, 0, NULL, NULL, NULL };
+            DecisaoLote *d = (DecisaoLote*)bsearch(&chave, decisoes, n, sizeof(DecisaoLote), comparaDecisoes);
+            // Um voluntário que se candidatou duas vezes tem duas decisões com
+            // a mesma chave, contíguas depois de ordenar: cada candidatura
+            // fica com a primeira ainda livre
+            while(d && d > decisoes && comparaDecisoes(d - 1, &chave) == 0) d--;
+            while(d && d < decisoes + n && comparaDecisoes(d, &chave) == 0 && d->candidatura) d++;
+            if(d && d < decisoes + n && comparaDecisoes(d, &chave) == 0) d->candidatura = aux;
+        }
+        pp = &aux->next;
+    }
+
+    for(int i = 0; i < n; i++) {
+        if(!decisoes[i].candidatura) return "candidatura repetida ou que ja nao esta pendente";
+    }
+    return NULL;
+}
+
+// Aplica um lote de decisões "P" (uma por linha): todas ou nenhuma, sem
+// largar o mutex entre elas, e cada uma entra no log. Devolve o erro ou NULL.
+const char* aplicaLote(const char *linhas, unsigned long long *seq) {
+    size_t tamanho = strlen(linhas) + 1;
+    int n = 0;
+    for(const char *c = linhas; *c; c++) n += *c == '\n';
+    if(tamanho > 1 && linhas[tamanho - 2] != '\n') n++;
+    if(n == 0) return "lote vazio";
+
+    // Duas cópias: uma é partida em campos, a outra vai intacta para o log
+    char *campos = (char*)malloc(tamanho);
+    char *originais = (char*)malloc(tamanho);
+    DecisaoLote *decisoes = (DecisaoLote*)calloc(n, sizeof(DecisaoLote));
+    const char *erro = "sem memoria";
+
+    if(campos && originais && decisoes) {
+        memcpy(campos, linhas, tamanho);
+        memcpy(originais, linhas, tamanho);
+
+        pthread_mutex_lock(&mutexDados);
+        if(modoReplicacao == REPLICA) erro = MUTACAO_ENCAMINHAR;
+        else erro = preparaLote(campos, originais, decisoes, n);
+
+        for(int i = 0; !erro && i < n; i++) {
+            processaCandidatura(decisoes[i].candidatura, decisoes[i].aceitar, decisoes[i].mensagem);
+            registaMutacao(decisoes[i].linha);
+        }
+        if(!erro && seq) *seq = logFim;
+        pthread_mutex_unlock(&mutexDados);
+    }
+
+    free(campos);
+    free(originais);
+    free(decisoes);
+    return erro;
+}
+
+// Envia a mutação (ou, com numLinhas > 0, um lote dessas linhas) ao primário
+// e espera pela resposta e, se possível, por vê-la aplicada localmente (para
+// o usuário ler a própria escrita)
+int encaminhaMutacao(const char *linha, int numLinhas, char erro[MAX_STR]) {
+    PedidoReplica pedido;
+    Texto mensagem = { NULL, 0, 0, 0, 1 };
+    struct timespec limite;
+
+    memset(&pedido, 0, sizeof(pedido));
+    clock_gettime(CLOCK_REALTIME, &limite);
+    limite.tv_sec += ESPERA_PRIMARIO;
+
+    pthread_mutex_lock(&estadoReplica.mutex);
+    // Enquanto a réplica (re)carrega o snapshot o envio espera pela ligação
+    while(estadoReplica.sockfd < 0 &&
+          pthread_cond_timedwait(&estadoReplica.mudou, &estadoReplica.mutex, &limite) == 0);
+    pedido.id = ++estadoReplica.proxPedido;
+    if(numLinhas > 0) textoAcrescenta(&mensagem, "B %llu %d\n%s", pedido.id, numLinhas, linha);
+    else textoAcrescenta(&mensagem, "M %llu %s\n", pedido.id, linha);
+    if(estadoReplica.sockfd < 0 || !mensagem.usado ||
+       !enviaTudo(estadoReplica.sockfd, mensagem.dados, mensagem.usado)) {
+        pthread_mutex_unlock(&estadoReplica.mutex);
+        textoLiberta(&mensagem);
+        snprintf(erro, MAX_STR, "servidor primario indisponivel");
+        return 0;
+    }
+    textoLiberta(&mensagem);
+    pedido.next = estadoReplica.pedidos;
+    estadoReplica.pedidos = &pedido;
+
+    while(!pedido.respondido &&
+          pthread_cond_timedwait(&estadoReplica.mudou, &estadoReplica.mutex, &limite) == 0);
+    while(pedido.respondido && !pedido.erro[0] && estadoReplica.aplicado < pedido.seq &&
+          pthread_cond_timedwait(&estadoReplica.mudou, &estadoReplica.mutex, &limite) == 0);
+
+    PedidoReplica **pp = &estadoReplica.pedidos;
+    while(*pp != &pedido) pp = &(*pp)->next;
+    *pp = pedido.next;
+    pthread_mutex_unlock(&estadoReplica.mutex);
+
+    if(!pedido.respondido) {
+        snprintf(erro, MAX_STR, "servidor primario nao respondeu");
+        return 0;
+    }
+    if(pedido.erro[0]) {
+        snprintf(erro, MAX_STR, "%s", pedido.erro);
+        return 0;
+    }
+    return 1;
+}
+
+// Ponto único de entrada das mutações feitas pelos menus.
+// Devolve 1 em caso de sucesso ou 0 com a descrição em 'erro'.
+int executaMutacao(const char *linha, char erro[MAX_STR]) {
+    char copia[MAX_LINHA_IMPORTACAO];
+
+    if(!linha) {
+        snprintf(erro, MAX_STR, "sem memoria");
+        return 0;
+    }
+    snprintf(copia, sizeof(copia), "%s", linha);
+    removeNewline(copia);
+
+    const char *falha = modoReplicacao == REPLICA ? MUTACAO_ENCAMINHAR : aplicaMutacao(copia, NULL);
+    if(falha == MUTACAO_ENCAMINHAR) return encaminhaMutacao(copia, 0, erro);
+
+    if(falha) snprintf(erro, MAX_STR, "%s", falha);
+    return falha == NULL;
+}
+
+// Como executaMutacao, para um lote de numLinhas decisões terminadas por
+// '\n' que é aplicado todo ou nada (ver aplicaLote)
+int executaLote(const char *linhas, int numLinhas, char erro[MAX_STR]) {
+    if(!linhas) {
+        snprintf(erro, MAX_STR, "sem memoria");
+        return 0;
+    }
+    const char *falha = modoReplicacao == REPLICA ? MUTACAO_ENCAMINHAR : aplicaLote(linhas, NULL);
+    if(falha == MUTACAO_ENCAMINHAR) return encaminhaMutacao(linhas, numLinhas, erro);
+
+    if(falha) snprintf(erro, MAX_STR, "%s", falha);
+    return falha == NULL;
+}
+
+void enviaErro(int sockfd, const char *erro) {
+    char buffer[MAX_STR + 16];
+    snprintf(buffer, sizeof(buffer), "Erro: %s.\n", erro);
+    enviaCliente(sockfd, buffer, strlen(buffer));
+}
+
+// Estado completo, do registo mais antigo para o mais recente, para que a
+// réplica reconstrua as listas pela mesma ordem (mutexDados trancado)
+void geraSnapshot(Texto *t) {
+    User *u = listaUsuarios;
+    while(u && u->next) u = u->next;
+    for(; u; u = u->prev) serializaUsuario(t, u);
+
+    Challenge *c = listaDesafios;
+    while(c && c->next) c = c->next;
+    for(; c; c = c->prev) serializaDesafio(t, c);
+
+    size_t num = 0;
+    Application **pp = &listaCandidaturas, *aux;
+    while((aux = candidaturaValida(pp)) != NULL) {
+        num++;
+        pp = &aux->next;
+    }
+    Application **ordem = (Application**)malloc((num ? num : 1) * sizeof(Application*));
+    if(!ordem) return;
+    size_t i = num;
+    for(aux = listaCandidaturas; aux; aux = aux->next) ordem[--i] = aux;
+
+    for(i = 0; i < num; i++) {
+        const char *desafio = resolveDesafio(ordem[i]->desafio)->nomeDesafio;
+        const char *engenheiro = loginUsuario(resolveUsuario(ordem[i]->engenheiro));
+        const char *associacao = loginUsuario(resolveUsuario(ordem[i]->associacao));
+
+        textoCampo(t, "C", 0);
+        textoCampo(t, desafio, 0);
+        textoCampo(t, engenheiro, 0);
+        textoCampo(t, associacao, 1);
+        if(ordem[i]->status != 0) {
+            textoCampo(t, "P", 0);
+            textoCampo(t, desafio, 0);
+            textoCampo(t, engenheiro, 0);
+            textoCampo(t, associacao, 0);
+            textoCampo(t, ordem[i]->status == 1 ? "1" : "2", 0);
+            textoCampo(t, ordem[i]->mensagem, 1);
+        }
+    }
+    free(ordem);
+}
+
+// Envia o texto à réplica e esvazia-o
+int enviaParaReplica(Replica *r, Texto *t) {
+    pthread_mutex_lock(&r->mutexEnvio);
+    int ok = enviaTudo(r->sockfd, t->dados, t->usado);
+    pthread_mutex_unlock(&r->mutexEnvio);
+    t->usado = 0;
+    return ok;
+}
+
+// Lê as confirmações e as mutações encaminhadas pela réplica
+void* recebeDaReplica(void *arg) {
+    Replica *r = (Replica*)arg;
+    char linha[MAX_LINHA_PROTOCOLO];
+    Texto lote = { NULL, 0, 0, 0, 0 };
+    unsigned long long seq, id, n;
+    int pos;
+
+    while(recebeLinha(r->sockfd, linha, sizeof(linha)) >= 0) {
+        const char *erro;
+
+        if(sscanf(linha, "A %llu", &seq) == 1) {
+            pthread_mutex_lock(&mutexDados);
+            r->confirmado = seq;
+            pthread_mutex_unlock(&mutexDados);
+            continue;
+        } else if(sscanf(linha, "M %llu %n", &id, &pos) == 1) {
+            erro = aplicaMutacao(linha + pos, &seq);
+        } else if(sscanf(linha, "B %llu %llu", &id, &n) == 2) {
+            if(n == 0 || !recebeRegistos(r->sockfd, &lote, n)) break;
+            erro = aplicaLote(lote.dados, &seq);
+        } else {
+            continue;
+        }
+
+        char resposta[MAX_STR + 64];
+        if(erro) snprintf(resposta, sizeof(resposta), "E %llu %s\n", id, erro);
+        else snprintf(resposta, sizeof(resposta), "R %llu %llu\n", id, seq);
+
+        pthread_mutex_lock(&r->mutexEnvio);
+        enviaTudo(r->sockfd, resposta, strlen(resposta));
+        pthread_mutex_unlock(&r->mutexEnvio);
+    }
+    textoLiberta(&lote);
+
+    pthread_mutex_lock(&mutexDados);
+    r->ligada = 0;
+    pthread_cond_broadcast(&novaMutacao);
+    pthread_mutex_unlock(&mutexDados);
+    return NULL;
+}
+
+// Lê o segredo (primeira linha, "K <segredo>") com um prazo e compara-o em
+// tempo constante. Nada mais pode ter chegado antes do snapshot.
+int autenticaReplica(Replica *r) {
+    char linha[MAX_LINHA_PROTOCOLO];
+    struct timeval prazo = { ESPERA_AUTENTICACAO, 0 };
+    setsockopt(r->sockfd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+    int recebida = recebeLinha(r->sockfd, linha, sizeof(linha)) >= 0;
+    prazo.tv_sec = 0;
+    setsockopt(r->sockfd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+
+    if(!recebida || strncmp(linha, "K ", 2) != 0 || entrada.inicio != entrada.fim) return 0;
+
+    const char *recebido = linha + 2;
+    size_t len = strlen(segredoReplicacao);
+    if(!len || strlen(recebido) != len) return 0;
+    unsigned char diferenca = 0;
+    for(size_t i = 0; i < len; i++) {
+        diferenca |= (unsigned char)(recebido[i] ^ segredoReplicacao[i]);
+    }
+    return diferenca == 0;
+}
+
+// Thread do primário por réplica: snapshot e depois lotes do log
+void* atendeReplica(void *arg) {
+    Replica *r = (Replica*)arg;
+    Texto t = { NULL, 0, 0, 0, 0 };
+    pthread_t receptor;
+
+    if(!r->autenticada && !autenticaReplica(r)) {
+        printf("Replica %s recusada: segredo em falta ou errado.\n", r->endereco);
+        close(r->sockfd);
+        pthread_mutex_destroy(&r->mutexEnvio);
+        free(r);
+        return NULL;
+    }
+    r->autenticada = 1;
+    printf("Replica %s ligada.\n", r->endereco);
+
+    pthread_mutex_lock(&mutexDados);
+    unsigned long long seq = logFim;
+    textoAcrescenta(&t, "S %llu\n", seq);
+    geraSnapshot(&t);
+    textoAcrescenta(&t, "F\n");
+    r->confirmado = 0;
+    r->next = listaReplicas;
+    listaReplicas = r;
+    pthread_mutex_unlock(&mutexDados);
+
+    int comReceptor = pthread_create(&receptor, NULL, recebeDaReplica, r) == 0;
+    int ok = comReceptor && enviaParaReplica(r, &t);
+
+    while(ok) {
+        struct timespec limite;
+        clock_gettime(CLOCK_REALTIME, &limite);
+        limite.tv_sec += 1;
+
+        pthread_mutex_lock(&mutexDados);
+        while(seq == logFim && r->ligada &&
+              pthread_cond_timedwait(&novaMutacao, &mutexDados, &limite) == 0);
+
+        // Fora do log circular: a réplica volta a ligar-se e recebe um snapshot
+        if(!r->ligada || logFim - seq > TAM_LOG_REPLICACAO) {
+            pthread_mutex_unlock(&mutexDados);
+            break;
+        }
+
+        if(seq == logFim) {
+            textoAcrescenta(&t, "H %llu\n", logFim);
+        } else {
+            textoAcrescenta(&t, "L %llu %llu\n", seq, logFim - seq);
+            for(; seq < logFim; seq++) {
+                textoAcrescenta(&t, "%s\n", logMutacoes[seq % TAM_LOG_REPLICACAO]);
+            }
+        }
+        pthread_mutex_unlock(&mutexDados);
+
+        ok = enviaParaReplica(r, &t);
+    }
+
+    shutdown(r->sockfd, SHUT_RDWR);
+    if(comReceptor) pthread_join(receptor, NULL);
+
+    pthread_mutex_lock(&mutexDados);
+    Replica **pp = &listaReplicas;
+    while(*pp && *pp != r) pp = &(*pp)->next;
+    if(*pp) *pp = r->next;
+    pthread_mutex_unlock(&mutexDados);
+
+    printf("Replica %s desligada.\n", r->endereco);
+    close(r->sockfd);
+    pthread_mutex_destroy(&r->mutexEnvio);
+    free(r);
+    textoLiberta(&t);
+    return NULL;
+}
+
+// Aceita réplicas na porta de replicação do primário
+void* escutaReplicas(void *arg) {
+    int sockfd = (int)(intptr_t)arg;
+
+    while(1) {
+        struct sockaddr_in endereco;
+        int fd = aceitaConexao(sockfd, &endereco);
+        if(fd == ACEITE_PARAGEM) break;
+        if(fd < 0) {
+            perror("Erro no accept da replica");
+            continue;
+        }
+
+        Replica *r = (Replica*)calloc(1, sizeof(Replica));
+        if(!r) {
+            close(fd);
+            continue;
+        }
+        char ip[INET_ADDRSTRLEN];
+        inet_ntop(AF_INET, &endereco.sin_addr, ip, sizeof(ip));
+        snprintf(r->endereco, sizeof(r->endereco), "%s:%d", ip, ntohs(endereco.sin_port));
+        r->sockfd = fd;
+        r->ligada = 1;
+        pthread_mutex_init(&r->mutexEnvio, NULL);
+
+        pthread_t thread;
+        if(pthread_create(&thread, NULL, atendeReplica, r) != 0) {
+            close(fd);
+            free(r);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+    return NULL;
+}
+
+// Liberta as candidaturas antes de as recarregar do snapshot. Não têm
+// handles, pelo que nada fora da lista as referencia (mutexDados trancado).
+void descartaCandidaturas(void) {
+    while(listaCandidaturas) {
+        Application *app = listaCandidaturas;
+        listaCandidaturas = app->next;
+        User *engenheiro = resolveUsuario(app->engenheiro);
+        if(engenheiro) engenheiro->memoria -= sizeof(Application);
+        free(app);
+        contaMemoria(MEM_CANDIDATURAS, -(long long)sizeof(Application));
+    }
+}
+
+void usuarioParaInicio(User *u) {
+    if(!u->prev) return;
+    u->prev->next = u->next;
+    if(u->next) u->next->prev = u->prev;
+    u->prev = NULL;
+    u->next = listaUsuarios;
+    listaUsuarios->prev = u;
+    listaUsuarios = u;
+}
+
+void desafioParaInicio(Challenge *c) {
+    if(!c->prev) return;
+    c->prev->next = c->next;
+    if(c->next) c->next->prev = c->prev;
+    c->prev = NULL;
+    c->next = listaDesafios;
+    listaDesafios->prev = c;
+    listaDesafios = c;
+}
+
+// Aplica um registo V, A ou D do snapshot. Um registo que já exista com a
+// mesma chave (login ou nome do desafio) e, nos usuários, a mesma
+// identidade é atualizado no lugar: o handle não muda e as sessões e candidaturas que o referem continuam válidas. Tal como
+// os novos, passa para o início da lista, pelo que no fim os registos do
+// snapshot ficam à frente, pela ordem do primário; os contadores *Vistos
+// contam-nos.
+const char* sincronizaRegisto(char *linha, int *usuariosVistos, int *desafiosVistos) {
+    char copia[MAX_LINHA_IMPORTACAO];
+    char *campos[MAX_CAMPOS];
+    snprintf(copia, sizeof(copia), "%s", linha);
+    int n = divideCampos(copia, campos);
+    if(n > MAX_CAMPOS) return "campos a mais";
+
+    if(strcmp(campos[0], "D") == 0) {
+        Challenge novo;
+        memset(&novo, 0, sizeof(novo));
+        const char *erro = leDesafio(&novo, campos, n);
+        Challenge *c = erro ? NULL : encontraDesafio(novo.nomeDesafio);
+        if(!c) {
+            erro = erro ? erro : aplicaLinha(linha);
+        } else {
+            strcpy(c->descricao, novo.descricao);
+            strcpy(c->tipoEngenheiro, novo.tipoEngenheiro);
+            c->horasEstimadas = novo.horasEstimadas;
+            strcpy(c->associacao, novo.associacao);
+            desafioParaInicio(c);
+        }
+        if(!erro) (*desafiosVistos)++;
+        return erro;
+    }
+    if(strcmp(campos[0], "V") != 0 && strcmp(campos[0], "A") != 0) return aplicaLinha(linha);
+
+    User novo;
+    memset(&novo, 0, sizeof(novo));
+    const char *erro = campos[0][0] == 'V' ? leVoluntario(&novo, campos, n) : leAssociacao(&novo, campos, n);
+    if(erro) return erro;
+    if(strncmp(senhaUsuario(&novo), PREFIXO_HASH, strlen(PREFIXO_HASH)) != 0) return "senha sem hash";
+
+    User *u = encontraUsuarioPorLogin(loginUsuario(&novo));
+    if(u && u->userType == ADMIN) return "login duplicado";
+    // Mesmo login noutro papel ou com outra identidade: é outro usuário,
+    // criado no primário depois de o anterior ter sido removido. Recebe um
+    // handle novo, para que as sessões e os tokens do anterior caduquem.
+    if(u && (u->userType != novo.userType || strcmp(u->identidade, novo.identidade) != 0)) {
+        removeUsuario(u->id);
+        u = NULL;
+    }
+    if(!u) {
+        erro = aplicaLinha(linha);
+    } else {
+        // O login (chave do índice) não muda; os restantes campos sim
+        if(u->userType == VOLUNTARIO) u->engineerData = novo.engineerData;
+        else u->assocData = novo.assocData;
+        usuarioParaInicio(u);
+    }
+    if(!erro) (*usuariosVistos)++;
+    return erro;
+}
+
+// Remove os registos que ficaram depois dos 'vistos' primeiros da lista,
+// ou seja, os que já não existem no primário (o admin fica sempre)
+void removeNaoVistos(int usuariosVistos, int desafiosVistos) {
+    User *u = listaUsuarios;
+    for(int i = 0; u && i < usuariosVistos; i++) u = u->next;
+    while(u) {
+        User *prox = u->next;
+        if(u->userType != ADMIN) removeUsuario(u->id);
+        u = prox;
+    }
+
+    Challenge *c = listaDesafios;
+    for(int i = 0; c && i < desafiosVistos; i++) c = c->next;
+    while(c) {
+        Challenge *prox = c->next;
+        removeAnexos(c->nomeDesafio);
+        removeDesafio(c->id);
+        c = prox;
+    }
+}
+
+// Aplica os registos de uma só vez, sem que as leituras vejam o estado
+// intermédio. Com 'snapshot' os dados locais passam a ser os do snapshot,
+// reconciliados por chave para manter os handles (ver sincronizaRegisto):
+// uma réplica que volte a ligar-se, ou o processo antigo de um reinício,
+// não perde as sessões nem os tokens que emitiu.
+void aplicaRegistos(Texto *t, int snapshot) {
+    char *guarda = NULL;
+    int usuariosVistos = 0, desafiosVistos = 0;
+
+    pthread_mutex_lock(&mutexDados);
+    if(snapshot) descartaCandidaturas();
+    for(char *linha = t->usado ? strtok_r(t->dados, "\n", &guarda) : NULL; linha;
+        linha = strtok_r(NULL, "\n", &guarda)) {
+        const char *erro = snapshot ? sincronizaRegisto(linha, &usuariosVistos, &desafiosVistos)
+                                    : aplicaLinha(linha);
+        if(erro) fprintf(stderr, "Replicacao: registo rejeitado (%s)\n", erro);
+    }
+    if(snapshot) removeNaoVistos(usuariosVistos, desafiosVistos);
+    pthread_mutex_unlock(&mutexDados);
+}
+
+// Regista o progresso da réplica e confirma-o ao primário
+void marcaAplicado(unsigned long long seq) {
+    char confirmacao[32];
+    snprintf(confirmacao, sizeof(confirmacao), "A %llu\n", seq);
+
+    pthread_mutex_lock(&estadoReplica.mutex);
+    estadoReplica.aplicado = seq;
+    if(seq > estadoReplica.seqPrimario) estadoReplica.seqPrimario = seq;
+    enviaTudo(estadoReplica.sockfd, confirmacao, strlen(confirmacao));
+    pthread_cond_broadcast(&estadoReplica.mudou);
+    pthread_mutex_unlock(&estadoReplica.mutex);
+}
+
+void respondePedido(unsigned long long id, const char *erro, unsigned long long seq) {
+    pthread_mutex_lock(&estadoReplica.mutex);
+    for(PedidoReplica *p = estadoReplica.pedidos; p; p = p->next) {
+        if(p->id == id) {
+            p->respondido = 1;
+            p->seq = seq;
+            snprintf(p->erro, sizeof(p->erro), "%s", erro ? erro : "");
+            break;
+        }
+    }
+    pthread_cond_broadcast(&estadoReplica.mudou);
+    pthread_mutex_unlock(&estadoReplica.mutex);
+}
+
+int ligaAoPrimario(void) {
+    struct sockaddr_in endereco;
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sin_family = AF_INET;
+    endereco.sin_port = htons(estadoReplica.porta);
+    if(inet_pton(AF_INET, estadoReplica.host, &endereco.sin_addr) != 1) return -1;
+
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+
+    char autenticacao[MAX_STR + 4];
+    snprintf(autenticacao, sizeof(autenticacao), "K %s\n", segredoReplicacao);
+    if(connect(fd, (struct sockaddr*)&endereco, sizeof(endereco)) < 0 ||
+       !enviaTudo(fd, autenticacao, strlen(autenticacao))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Segue o primário ligado em fd até a ligação cair. A ligação só fica
+// disponível para encaminhar mutações depois de aplicado o snapshot.
+void segueOPrimario(int fd) {
+    char linha[MAX_LINHA_PROTOCOLO];
+    Texto registos = { NULL, 0, 0, 0, 0 };
+
+    // Descarta o que tenha sobrado de uma ligação anterior no buffer da thread
+    entrada.inicio = entrada.fim = 0;
+
+    while(recebeLinha(fd, linha, sizeof(linha)) >= 0) {
+        unsigned long long seq, n, id;
+        int pos;
+
+        if(sscanf(linha, "S %llu", &seq) == 1) {
+            if(!recebeRegistos(fd, &registos, 0)) break;
+            aplicaRegistos(&registos, 1);
+            pthread_mutex_lock(&estadoReplica.mutex);
+            estadoReplica.sockfd = fd;
+            pthread_cond_broadcast(&estadoReplica.mudou);
+            pthread_mutex_unlock(&estadoReplica.mutex);
+            marcaAplicado(seq);
+        } else if(sscanf(linha, "L %llu %llu", &seq, &n) == 2) {
+            if(!recebeRegistos(fd, &registos, n)) break;
+            aplicaRegistos(&registos, 0);
+            marcaAplicado(seq + n);
+        } else if(sscanf(linha, "H %llu", &seq) == 1) {
+            pthread_mutex_lock(&estadoReplica.mutex);
+            estadoReplica.seqPrimario = seq;
+            pthread_mutex_unlock(&estadoReplica.mutex);
+        } else if(sscanf(linha, "R %llu %llu", &id, &seq) == 2) {
+            respondePedido(id, NULL, seq);
+        } else if(sscanf(linha, "E %llu %n", &id, &pos) == 1) {
+            respondePedido(id, linha + pos, 0);
+        }
+    }
+
+    // Os pedidos pendentes falham de imediato em vez de esperar o prazo
+    pthread_mutex_lock(&estadoReplica.mutex);
+    estadoReplica.sockfd = -1;
+    for(PedidoReplica *p = estadoReplica.pedidos; p; p = p->next) {
+        if(!p->respondido) {
+            p->respondido = 1;
+            snprintf(p->erro, sizeof(p->erro), "ligacao ao servidor primario perdida");
+        }
+    }
+    pthread_cond_broadcast(&estadoReplica.mudou);
+    pthread_mutex_unlock(&estadoReplica.mutex);
+
+    textoLiberta(&registos);
+}
+
+// Thread da réplica: liga-se ao primário e volta a ligar-se se a ligação cair
+void* replicaDoPrimario(void *arg) {
+    (void)arg;
+
+    while(1) {
+        int fd = ligaAoPrimario();
+        if(fd < 0) {
+            sleep(1);
+            continue;
+        }
+        printf("Ligado ao primario %s:%d.\n", estadoReplica.host, estadoReplica.porta);
+
+        segueOPrimario(fd);
+
+        close(fd);
+        fprintf(stderr, "Ligacao ao primario perdida; a reconectar...\n");
+        sleep(1);
+    }
+    return NULL;
+}
+
+// Lê o segredo partilhado da primeira linha do ficheiro (devolve 0 se falhar)
+int leSegredo(const char *caminho) {
+    FILE *f = fopen(caminho, "r");
+    if(!f) return 0;
+    int lido = fgets(segredoReplicacao, sizeof(segredoReplicacao), f) != NULL;
+    fclose(f);
+    if(lido) removeNewline(segredoReplicacao);
+    return lido && segredoReplicacao[0];
+}
+
+// Abre a porta de replicação (primário, salvo se herdada num reinício) ou
+// liga-se ao primário (réplica)
+void iniciaReplicacao(int portaReplicacao) {
+    pthread_t thread;
+
+    if(modoReplicacao == REPLICA) {
+        if(pthread_create(&thread, NULL, replicaDoPrimario, NULL) != 0) {
+            perror("Erro ao criar thread de replicacao");
+            exit(1);
+        }
+        pthread_detach(thread);
+        printf("Replica do primario %s:%d.\n", estadoReplica.host, estadoReplica.porta);
+        return;
+    }
+
+    pthread_mutex_lock(&mutexDados);
+    logAtivo = 1;
+    pthread_mutex_unlock(&mutexDados);
+
+    if(socketReplicacao < 0) {
+        struct sockaddr_in endereco;
+        socketReplicacao = socket(AF_INET, SOCK_STREAM, 0);
+        if(socketReplicacao < 0) {
+            perror("Erro ao abrir socket de replicacao");
+            exit(1);
+        }
+
+        memset(&endereco, 0, sizeof(endereco));
+        endereco.sin_family = AF_INET;
+        endereco.sin_port = htons(portaReplicacao);
+        if(inet_pton(AF_INET, enderecoReplicacao, &endereco.sin_addr) != 1) {
+            fprintf(stderr, "Endereco de replicacao invalido: %s\n", enderecoReplicacao);
+            exit(1);
+        }
+
+        if(bind(socketReplicacao, (struct sockaddr*)&endereco, sizeof(endereco)) < 0 ||
+           listen(socketReplicacao, 5) < 0) {
+            perror("Erro no bind da porta de replicacao");
+            exit(1);
+        }
+        fcntl(socketReplicacao, F_SETFL, O_NONBLOCK);
+        printf("Primario: replicas aceites em %s:%d.\n", enderecoReplicacao, portaReplicacao);
+    } else {
+        printf("Primario: porta de replicacao herdada do processo anterior.\n");
+    }
+
+    if(pthread_create(&thread, NULL, escutaReplicas, (void*)(intptr_t)socketReplicacao) != 0) {
+        perror("Erro ao criar thread de replicacao");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+// Estado da replicação para o menu do administrador
+void mostraReplicacao(int sockfd) {
+    Texto t = { NULL, 0, 0, 0, 0 };
+
+    if(modoReplicacao == PRIMARIO) {
+        pthread_mutex_lock(&mutexDados);
+        textoAcrescenta(&t, "Primario: log em %llu\n", logFim);
+        if(!listaReplicas) textoAcrescenta(&t, "Nenhuma replica ligada.\n");
+        for(Replica *r = listaReplicas; r; r = r->next) {
+            textoAcrescenta(&t, "Replica %s: aplicado %llu, atraso %llu\n",
+                            r->endereco, r->confirmado, logFim - r->confirmado);
+        }
+        pthread_mutex_unlock(&mutexDados);
+    } else if(modoReplicacao == REPLICA) {
+        pthread_mutex_lock(&estadoReplica.mutex);
+        textoAcrescenta(&t, "Replica de %s:%d (%s): aplicado %llu, primario em %llu, atraso %llu\n",
+                        estadoReplica.host, estadoReplica.porta,
+                        estadoReplica.sockfd >= 0 ? "ligada" : "desligada",
+                        estadoReplica.aplicado, estadoReplica.seqPrimario,
+                        estadoReplica.seqPrimario - estadoReplica.aplicado);
+        pthread_mutex_unlock(&estadoReplica.mutex);
+    } else {
+        textoAcrescenta(&t, "Replicacao desativada.\n");
+    }
+    textoEnvia(sockfd, &t);
+}
+
+// --------------------------------------------------
+// Cadastro de usuários (F4)
+// --------------------------------------------------
+
+// Serializa o usuário (já com a senha em hash), liberta-o e executa o
+// cadastro; devolve 0 depois de enviar o erro ao cliente
+int registaUsuario(int sockfd, User *u) {
+    Texto t = { NULL, 0, 0, 0, 1 };
+    char erro[MAX_STR];
+
+    serializaUsuario(&t, u);
+    free(u);
+    int ok = executaMutacao(t.dados, erro);
+    textoLiberta(&t);
+
+    if(!ok) enviaErro(sockfd, erro);
+    return ok;
+}
+
+// Cadastro de usuário VOLUNTARIO
+void cadastrarVoluntario(int sockfd) {
+    char buffer[1024];
+    User *u = (User *) malloc(sizeof(User));
+    if(!u) return;
+
+    u->userType = VOLUNTARIO;
+
+    // Coletando dados
+    enviaCliente(sockfd, "Nome completo: ", 16);
+    recebeLinha(sockfd, u->engineerData.nomeCompleto, MAX_STR);
+
+    enviaCliente(sockfd, "OE number: ", 11);
+    recebeLinha(sockfd, u->engineerData.oeNumber, MAX_STR);
+
+    enviaCliente(sockfd, "Especialidade: ", 16);
+    recebeLinha(sockfd, u->engineerData.especialidade, MAX_STR);
+
+    enviaCliente(sockfd, "Instituicao de emprego: ", 25);
+    recebeLinha(sockfd, u->engineerData.instituicao, MAX_STR);
+
+    enviaCliente(sockfd, "Ainda é estudante? (0/1): ", 27);
+    recebeLinha(sockfd, buffer, 1024);
+    u->engineerData.aindaEstudante = atoi(buffer);
+
+    enviaCliente(sockfd, "Areas de expertise: ", 20);
+    recebeLinha(sockfd, u->engineerData.areasExpertise, MAX_STR);
+
+    enviaCliente(sockfd, "Email: ", 7);
+    recebeLinha(sockfd, u->engineerData.email, MAX_STR);
+
+    enviaCliente(sockfd, "Telefone (opcional): ", 21);
+    recebeLinha(sockfd, u->engineerData.telefone, MAX_STR);
+
+    enviaCliente(sockfd, "Login desejado: ", 17);
+    recebeLinha(sockfd, u->engineerData.login, MAX_STR);
+
+    enviaCliente(sockfd, "Senha desejada: ", 17);
+    recebeLinha(sockfd, u->engineerData.senha, MAX_STR);
+
+    // Evita calcular o hash (caro) para um login que já existe
+    pthread_mutex_lock(&mutexDados);
+    int existe = encontraUsuarioPorLogin(u->engineerData.login) != NULL;
+    pthread_mutex_unlock(&mutexDados);
+    if(existe) {
+        free(u);
+        enviaCliente(sockfd, "Login indisponivel.\n", 20);
+        return;
+    }
+
+    if(!hashSenha(u->engineerData.senha)) {
+        free(u);
+        enviaCliente(sockfd, "Servidor ocupado, tente novamente.\n", 35);
+        return;
+    }
+
+    if(!registaUsuario(sockfd, u)) return;
+    enviaCliente(sockfd, "Voluntario cadastrado com sucesso!\n", 36);
+}
+
+// Cadastro de usuário ASSOCIACAO
+void cadastrarAssociacao(int sockfd) {
+    char buffer[1024];
+    User *u = (User *) malloc(sizeof(User));
+    if(!u) return;
+
+    u->userType = ASSOCIACAO;
+
+    enviaCliente(sockfd, "Nome da Organizacao: ", 22);
+    recebeLinha(sockfd, u->assocData.nomeOrganizacao, MAX_STR);
+
+    enviaCliente(sockfd, "NIF: ", 6);
+    recebeLinha(sockfd, u->assocData.nif, MAX_STR);
+
+    enviaCliente(sockfd, "Email: ", 7);
+    recebeLinha(sockfd, u->assocData.email, MAX_STR);
+
+    enviaCliente(sockfd, "Endereco: ", 10);
+    recebeLinha(sockfd, u->assocData.endereco, MAX_STR);
+
+    enviaCliente(sockfd, "Descricao de Atividades: ", 25);
+    recebeLinha(sockfd, u->assocData.descricaoAtividades, MAX_STR);
+
+    enviaCliente(sockfd, "Telefone (opcional): ", 21);
+    recebeLinha(sockfd, u->assocData.telefone, MAX_STR);
+
+    enviaCliente(sockfd, "Login desejado: ", 17);
+    recebeLinha(sockfd, u->assocData.login, MAX_STR);
+
+    enviaCliente(sockfd, "Senha desejada: ", 17);
+    recebeLinha(sockfd, u->assocData.senha, MAX_STR);
+
+    // Evita calcular o hash (caro) para um login que já existe
+    pthread_mutex_lock(&mutexDados);
+    int existe = encontraUsuarioPorLogin(u->assocData.login) != NULL;
+    pthread_mutex_unlock(&mutexDados);
+    if(existe) {
+        free(u);
+        enviaCliente(sockfd, "Login indisponivel.\n", 20);
+        return;
+    }
+
+    if(!hashSenha(u->assocData.senha)) {
+        free(u);
+        enviaCliente(sockfd, "Servidor ocupado, tente novamente.\n", 35);
+        return;
+    }
+
+    if(!registaUsuario(sockfd, u)) return;
+    enviaCliente(sockfd, "Associacao cadastrada com sucesso!\n", 36);
+}
+
+// --------------------------------------------------
+// Sessões (retoma rápida de conexões)
+// --------------------------------------------------
+// Após o login o servidor emite um token de sessão. Um cliente que reconecte
+// pode enviar "TOKEN <token>" como primeira linha e volta diretamente ao seu
+// menu, sem repetir o login. A tabela está dividida em fragmentos, cada um
+// com o seu mutex, lista LRU e capacidade própria; sessões sem uso durante
+// VALIDADE_SESSAO segundos expiram.
+
+#define NUM_FRAGMENTOS_SESSOES 16
+#define BALDES_POR_FRAGMENTO   1024
+#define SESSOES_POR_FRAGMENTO  8192
+#define VALIDADE_SESSAO        1800 // segundos
+#define BYTES_TOKEN            16
+#define TAM_TOKEN              (BYTES_TOKEN * 2) // em hexadecimal
+
+typedef struct Sessao {
+    char token[TAM_TOKEN + 1];
+    Handle usuario;
+    time_t ultimoUso;
+    struct Sessao *proxBalde;
+    struct Sessao *lruAnt;  // mais recente
+    struct Sessao *lruProx; // menos recente
+} Sessao;
+
+typedef struct FragmentoSessoes {
+    pthread_mutex_t mutex;
+    Sessao *baldes[BALDES_POR_FRAGMENTO];
+    Sessao *lruCabeca; // usada mais recentemente
+    Sessao *lruCauda;  // candidata a expulsão
+    int numSessoes;
+} FragmentoSessoes;
+
+FragmentoSessoes fragmentosSessoes[NUM_FRAGMENTOS_SESSOES];
+
+void inicializaSessoes(void) {
+    for(int i = 0; i < NUM_FRAGMENTOS_SESSOES; i++) {
+        memset(&fragmentosSessoes[i], 0, sizeof(FragmentoSessoes));
+        pthread_mutex_init(&fragmentosSessoes[i].mutex, NULL);
+    }
+}
+
+// O fragmento e o balde saem de bits diferentes do mesmo hash
+FragmentoSessoes* fragmentoDoToken(const char *token, Sessao ***balde) {
+    uint32_t h = hashString(token);
+    FragmentoSessoes *f = &fragmentosSessoes[h % NUM_FRAGMENTOS_SESSOES];
+    *balde = &f->baldes[(h / NUM_FRAGMENTOS_SESSOES) % BALDES_POR_FRAGMENTO];
+    return f;
+}
+
+void lruDesliga(FragmentoSessoes *f, Sessao *s) {
+    if(s->lruAnt) s->lruAnt->lruProx = s->lruProx;
+    else f->lruCabeca = s->lruProx;
+    if(s->lruProx) s->lruProx->lruAnt = s->lruAnt;
+    else f->lruCauda = s->lruAnt;
+}
+
+void lruPoeNaCabeca(FragmentoSessoes *f, Sessao *s) {
+    s->lruAnt = NULL;
+    s->lruProx = f->lruCabeca;
+    if(f->lruCabeca) f->lruCabeca->lruAnt = s;
+    f->lruCabeca = s;
+    if(!f->lruCauda) f->lruCauda = s;
+}
+
+// Retira a sessão da tabela e da LRU e liberta-a (fragmento trancado)
+void descartaSessao(FragmentoSessoes *f, Sessao *s) {
+    Sessao **balde;
+    fragmentoDoToken(s->token, &balde);
+    while(*balde != s) balde = &(*balde)->proxBalde;
+    *balde = s->proxBalde;
+
+    lruDesliga(f, s);
+    f->numSessoes--;
+    free(s);
+    contaMemoria(MEM_SESSOES, -(long long)sizeof(Sessao));
+}
+
+// Insere a sessão com o token dado (novo ou herdado num reinício)
+int insereSessao(const char *token, Handle usuario, time_t ultimoUso) {
+    // Sem memória o login continua a funcionar, só não há token para retomar
+    if(memoriaEsgotada()) return 0;
+    Sessao *s = (Sessao*)malloc(sizeof(Sessao));
+    if(!s) return 0;
+    memcpy(s->token, token, TAM_TOKEN + 1);
+    s->usuario = usuario;
+    s->ultimoUso = ultimoUso;
+
+    Sessao **balde;
+    FragmentoSessoes *f = fragmentoDoToken(token, &balde);
+
+    pthread_mutex_lock(&f->mutex);
+    // Expulsa pela cauda as sessões expiradas e, se cheio, a menos recente
+    while(f->lruCauda &&
+          (f->numSessoes >= SESSOES_POR_FRAGMENTO ||
+           s->ultimoUso - f->lruCauda->ultimoUso > VALIDADE_SESSAO)) {
+        descartaSessao(f, f->lruCauda);
+    }
+    s->proxBalde = *balde;
+    *balde = s;
+    lruPoeNaCabeca(f, s);
+    f->numSessoes++;
+    contaMemoria(MEM_SESSOES, sizeof(Sessao));
+    pthread_mutex_unlock(&f->mutex);
+    return 1;
+}
+
+// Cria uma sessão para o usuário e escreve o token em 'token'
+int criaSessao(Handle usuario, char token[TAM_TOKEN + 1]) {
+    unsigned char aleatorio[BYTES_TOKEN];
+    if(getrandom(aleatorio, sizeof(aleatorio), 0) != sizeof(aleatorio)) return 0;
+    for(int i = 0; i < BYTES_TOKEN; i++) {
+        snprintf(token + 2 * i, 3, "%02x", aleatorio[i]);
+    }
+    return insereSessao(token, usuario, time(NULL));
+}
+
+// Devolve o usuário da sessão (renovando-a) ou HANDLE_INVALIDO se não existir ou tiver expirado
+Handle retomaSessao(const char *token) {
+    Handle usuario = HANDLE_INVALIDO;
+    time_t agora = time(NULL);
+
+    if(strlen(token) != TAM_TOKEN) return HANDLE_INVALIDO;
+
+    Sessao **balde;
+    FragmentoSessoes *f = fragmentoDoToken(token, &balde);
+
+    pthread_mutex_lock(&f->mutex);
+    Sessao *s = *balde;
+    while(s && strcmp(s->token, token) != 0) s = s->proxBalde;
+
+    if(s && agora - s->ultimoUso > VALIDADE_SESSAO) {
+        descartaSessao(f, s);
+    } else if(s) {
+        s->ultimoUso = agora;
+        lruDesliga(f, s);
+        lruPoeNaCabeca(f, s);
+        usuario = s->usuario;
+    }
+    pthread_mutex_unlock(&f->mutex);
+    return usuario;
+}
+
+// Termina a sessão (saída explícita pelo menu)
+void terminaSessao(const char *token) {
+    Sessao **balde;
+    FragmentoSessoes *f = fragmentoDoToken(token, &balde);
+
+    pthread_mutex_lock(&f->mutex);
+    Sessao *s = *balde;
+    while(s && strcmp(s->token, token) != 0) s = s->proxBalde;
+    if(s) descartaSessao(f, s);
+    pthread_mutex_unlock(&f->mutex);
+}
+
+// --------------------------------------------------
+// Reinício sem interrupção
+// --------------------------------------------------
+// Com "-u caminho" o servidor escuta num socket Unix por um processo que o
+// venha substituir (uma nova versão arrancada com o mesmo caminho). O socket
+// é criado com o modo 0600 e, dos dois lados, a ligação só é aceite se o
+// outro processo (SO_PEERCRED) for do mesmo utilizador. O processo novo
+// liga-se ao antigo, pede "ASSUME" e recebe:
+//   1. os sockets de escuta (clientes e, no primário, réplicas) por SCM_RIGHTS,
+//      pelo que a porta nunca deixa de aceitar ligações;
+//   2. um snapshot dos dados ("S seq" ... "F", como uma réplica) seguido das
+//      sessões ativas ("T token segundos_sem_uso login") e de "F", pelo que
+//      nada é relido do disco e os tokens continuam válidos.
+// No mesmo instante em que gera o snapshot, o processo antigo passa a réplica
+// do novo pela mesma ligação e deixa de aceitar conexões: as mutações das
+// sessões que ainda atende são encaminhadas ao novo processo e as leituras
+// seguem o log deste. O processo novo começa por lhe enviar um snapshot,
+// que pode já conter mutações posteriores à troca; o processo antigo
+// reconcilia-o por chave (ver aplicaRegistos), pelo que os handles das suas
+// sessões não mudam e estas continuam ativas até o cliente sair. O processo
+// antigo sai quando a última conexão fechar.
+// O processo antigo só deixa de aceitar conexões quando o novo lhe enviar
+// "OK", já pronto a aceitá-las; sem essa confirmação retoma o seu papel e
+// continua a servir. Se mais tarde perder a ligação ao processo novo (que
+// saiu ou foi por sua vez substituído), volta a ligar-se ao caminho com
+// "SEGUE" e segue quem lá estiver; não havendo ninguém, termina as sessões
+// em curso.
+// As conexões que chegam durante a troca esperam na fila do listen.
+
+#define MAX_SOCKETS_HERDADOS   2
+#define ESPERA_PEDIDO_CONTROLO 5  // s para quem liga ao socket de controlo dizer ao que vem
+#define ESPERA_CONFIRMACAO     60 // s para o processo novo passar a servir
+#define TENTATIVAS_CONTROLO    10 // ligações ao socket de controlo (uma por s) antes de desistir
+
+void terminaConexoes(void); // ver despachaConexao
+
+int socketClientes = -1; // escuta dos clientes, entregue ao processo novo
+
+// Sessões ainda válidas, das menos para as mais recentes (mutexDados trancado)
+void serializaSessoes(Texto *t) {
+    time_t agora = time(NULL);
+
+    for(int i = 0; i < NUM_FRAGMENTOS_SESSOES; i++) {
+        FragmentoSessoes *f = &fragmentosSessoes[i];
+        pthread_mutex_lock(&f->mutex);
+        for(Sessao *s = f->lruCauda; s; s = s->lruAnt) {
+            User *u = resolveUsuario(s->usuario);
+            if(!u || agora - s->ultimoUso > VALIDADE_SESSAO) continue;
+            textoAcrescenta(t, "T %s %ld %s\n", s->token, (long)(agora - s->ultimoUso), loginUsuario(u));
+        }
+        pthread_mutex_unlock(&f->mutex);
+    }
+}
+
+int enviaSockets(int fd, const int *sockets, int n) {
+    char quantos = '0' + n;
+    struct iovec iov = { &quantos, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_SOCKETS_HERDADOS)];
+        struct cmsghdr alinhamento;
+    } controlo;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    memset(&controlo, 0, sizeof(controlo));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = controlo.buf;
+    msg.msg_controllen = CMSG_SPACE(sizeof(int) * n);
+
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    c->cmsg_level = SOL_SOCKET;
+    c->cmsg_type = SCM_RIGHTS;
+    c->cmsg_len = CMSG_LEN(sizeof(int) * n);
+    memcpy(CMSG_DATA(c), sockets, sizeof(int) * n);
+
+    return sendmsg(fd, &msg, 0) == 1;
+}
+
+// Devolve o número de sockets recebidos ou -1
+int recebeSockets(int fd, int sockets[MAX_SOCKETS_HERDADOS]) {
+    char quantos;
+    struct iovec iov = { &quantos, 1 };
+    union {
+        char buf[CMSG_SPACE(sizeof(int) * MAX_SOCKETS_HERDADOS)];
+        struct cmsghdr alinhamento;
+    } controlo;
+    struct msghdr msg;
+
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov = &iov;
+    msg.msg_iovlen = 1;
+    msg.msg_control = controlo.buf;
+    msg.msg_controllen = sizeof(controlo.buf);
+
+    if(recvmsg(fd, &msg, 0) != 1) return -1;
+    struct cmsghdr *c = CMSG_FIRSTHDR(&msg);
+    if(!c || c->cmsg_level != SOL_SOCKET || c->cmsg_type != SCM_RIGHTS) return -1;
+
+    int n = (c->cmsg_len - CMSG_LEN(0)) / sizeof(int);
+    if(n < 1 || n > MAX_SOCKETS_HERDADOS || n != quantos - '0') return -1;
+    memcpy(sockets, CMSG_DATA(c), sizeof(int) * n);
+    return n;
+}
+
+// Só processos do mesmo utilizador que este servidor passam pelo socket de
+// controlo, dos dois lados da ligação
+int mesmoUtilizador(int fd) {
+    struct ucred credenciais;
+    socklen_t len = sizeof(credenciais);
+    return getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &credenciais, &len) == 0 &&
+           credenciais.uid == geteuid();
+}
+
+// Liga-se ao servidor que escuta em 'caminho' e faz-lhe o pedido (ASSUME ou
+// SEGUE); devolve o descritor ou -1 se não houver lá um servidor nosso
+int ligaAoControlo(const char *caminho, const char *pedido) {
+    struct sockaddr_un endereco;
+    char linha[16];
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(fd < 0) return -1;
+
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    snprintf(endereco.sun_path, sizeof(endereco.sun_path), "%s", caminho);
+    snprintf(linha, sizeof(linha), "%s\n", pedido);
+
+    if(connect(fd, (struct sockaddr*)&endereco, sizeof(endereco)) < 0) {
+        close(fd);
+        return -1;
+    }
+    if(!mesmoUtilizador(fd)) {
+        fprintf(stderr, "O socket de controlo %s pertence a outro utilizador\n", caminho);
+        close(fd);
+        return -1;
+    }
+    if(!enviaTudo(fd, linha, strlen(linha))) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Espera pelo "OK" com que o processo novo diz que já passou a servir. É
+// lido com recv, fora do buffer de entrada, porque segueOPrimario descarta
+// o que lá estiver e o snapshot pode vir logo atrás.
+int esperaConfirmacao(int fd) {
+    char resposta[3];
+    struct timeval prazo = { ESPERA_CONFIRMACAO, 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+    int confirmado = recv(fd, resposta, sizeof(resposta), MSG_WAITALL) == (ssize_t)sizeof(resposta) &&
+                     memcmp(resposta, "OK\n", sizeof(resposta)) == 0;
+    prazo.tv_sec = 0;
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+    return confirmado;
+}
+
+// Processo antigo: entrega sockets, dados e sessões e passa a réplica do
+// processo novo. Só deixa de aceitar conexões quando o processo novo
+// confirmar que as aceita; devolve 0 (e continua como estava) se a entrega
+// falhar ou a confirmação não chegar.
+int entregaServidor(int fd) {
+    int sockets[MAX_SOCKETS_HERDADOS] = { socketClientes, socketReplicacao };
+    if(!enviaSockets(fd, sockets, socketReplicacao >= 0 ? 2 : 1)) {
+        perror("Erro ao entregar os sockets");
+        return 0;
+    }
+
+    Texto t = { NULL, 0, 0, 0, 0 };
+    pthread_mutex_lock(&mutexDados);
+    ModoReplicacao anterior = modoReplicacao;
+    textoAcrescenta(&t, "S %llu\n", logFim);
+    geraSnapshot(&t);
+    textoAcrescenta(&t, "F\n");
+    serializaSessoes(&t);
+    textoAcrescenta(&t, "F\n");
+    // A partir daqui as mutações deste processo vão para o processo novo
+    modoReplicacao = REPLICA;
+    pthread_mutex_unlock(&mutexDados);
+
+    int ok = enviaTudo(fd, t.dados, t.usado);
+    textoLiberta(&t);
+    if(!ok) {
+        fprintf(stderr, "Erro ao enviar os dados ao novo processo\n");
+    } else if(!(ok = esperaConfirmacao(fd))) {
+        fprintf(stderr, "O novo processo nao confirmou que esta a servir\n");
+    }
+
+    pthread_mutex_lock(&mutexDados);
+    if(!ok) {
+        modoReplicacao = anterior;
+    } else {
+        // As réplicas deste processo voltam a ligar-se, agora ao processo novo
+        for(Replica *r = listaReplicas; r; r = r->next) shutdown(r->sockfd, SHUT_RDWR);
+    }
+    pthread_mutex_unlock(&mutexDados);
+    if(!ok) return 0;
+
+    pthread_mutex_lock(&estadoReplica.mutex);
+    snprintf(estadoReplica.host, sizeof(estadoReplica.host), "processo novo");
+    estadoReplica.porta = 0;
+    pthread_mutex_unlock(&estadoReplica.mutex);
+
+    // Os ciclos de accept terminam; o main drena as conexões e sai
+    if(write(pipeParagem[1], "x", 1) != 1) perror("Erro ao parar o accept");
+    return 1;
+}
+
+// Cria a réplica "processo anterior", que segue este processo pela ligação
+// de controlo fd; devolve 0 se não foi possível
+int acompanhaProcesso(int fd) {
+    Replica *r = (Replica*)calloc(1, sizeof(Replica));
+    if(!r) return 0;
+    snprintf(r->endereco, sizeof(r->endereco), "processo anterior");
+    r->sockfd = fd;
+    r->ligada = 1;
+    r->autenticada = 1; // ligou-se pelo socket de controlo, do mesmo utilizador
+    pthread_mutex_init(&r->mutexEnvio, NULL);
+
+    pthread_mutex_lock(&mutexDados);
+    logAtivo = 1;
+    pthread_mutex_unlock(&mutexDados);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, atendeReplica, r) != 0) {
+        pthread_mutex_destroy(&r->mutexEnvio);
+        free(r);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+const char *caminhoControloAtual = NULL; // onde este processo escuta (-u)
+
+// Processo antigo, depois da entrega: segue o processo novo e, se a ligação
+// cair (o processo novo saiu ou foi por sua vez substituído), quem tiver
+// agora o socket de controlo. Se ninguém responder, termina as sessões em
+// curso em vez de as deixar sem primário para as mutações.
+void segueDonoControlo(int fd) {
+    for(int tentativas = 0; tentativas < TENTATIVAS_CONTROLO; tentativas++) {
+        if(fd >= 0) {
+            segueOPrimario(fd);
+            close(fd);
+            tentativas = 0;
+            fprintf(stderr, "Ligacao ao processo novo perdida; a procurar o servidor em %s...\n",
+                    caminhoControloAtual);
+        }
+        sleep(1);
+        fd = ligaAoControlo(caminhoControloAtual, "SEGUE");
+    }
+    fprintf(stderr, "Nenhum servidor em %s: a terminar as sessoes em curso.\n", caminhoControloAtual);
+    terminaConexoes();
+}
+
+// Thread do socket de controlo: espera pelo processo que nos vai substituir
+// (ASSUME) ou por um processo anterior que perdeu quem seguia (SEGUE)
+void* escutaControlo(void *arg) {
+    int sockfd = (int)(intptr_t)arg;
+    char pedido[16];
+
+    while(1) {
+        int fd = accept(sockfd, NULL, NULL);
+        if(fd < 0) {
+            perror("Erro no accept do socket de controlo");
+            continue;
+        }
+        if(!mesmoUtilizador(fd)) {
+            fprintf(stderr, "Ligacao ao socket de controlo recusada: outro utilizador\n");
+            close(fd);
+            continue;
+        }
+
+        // Uma linha, com prazo; nada mais chega antes de respondermos
+        struct timeval prazo = { ESPERA_PEDIDO_CONTROLO, 0 };
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+        int lido = recebeLinha(fd, pedido, sizeof(pedido)) >= 0 && entrada.inicio == entrada.fim;
+        prazo.tv_sec = 0;
+        setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &prazo, sizeof(prazo));
+        entrada.inicio = entrada.fim = 0;
+
+        if(lido && strcmp(pedido, "SEGUE") == 0) {
+            printf("Processo anterior volta a seguir este servidor.\n");
+            if(!acompanhaProcesso(fd)) close(fd);
+            continue;
+        }
+        if(!lido || strcmp(pedido, "ASSUME") != 0) {
+            close(fd);
+            continue;
+        }
+
+        printf("Novo processo a assumir o servidor...\n");
+        if(entregaServidor(fd)) {
+            // O caminho já pertence (ou vai pertencer) ao processo novo: não o apagar
+            close(sockfd);
+            segueDonoControlo(fd);
+            return NULL;
+        }
+        close(fd);
+    }
+}
+
+// Escuta em 'caminho' pelo próximo reinício
+void abreControlo(const char *caminho) {
+    struct sockaddr_un endereco;
+    int sockfd = socket(AF_UNIX, SOCK_STREAM, 0);
+
+    memset(&endereco, 0, sizeof(endereco));
+    endereco.sun_family = AF_UNIX;
+    snprintf(endereco.sun_path, sizeof(endereco.sun_path), "%s", caminho);
+
+    // Criado já com o modo 0600: só o nosso utilizador lhe consegue ligar
+    unlink(caminho);
+    mode_t mascara = umask(0177);
+    int ligado = sockfd >= 0 && bind(sockfd, (struct sockaddr*)&endereco, sizeof(endereco)) == 0;
+    umask(mascara);
+    if(!ligado || listen(sockfd, 1) < 0) {
+        perror("Erro ao abrir o socket de controlo");
+        exit(1);
+    }
+    caminhoControloAtual = caminho;
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, escutaControlo, (void*)(intptr_t)sockfd) != 0) {
+        perror("Erro ao criar thread de controlo");
+        exit(1);
+    }
+    pthread_detach(thread);
+}
+
+int controloAnterior = -1; // ligação ao processo anterior, até confirmaServidor
+
+// Processo novo: se houver um servidor a escutar em 'caminho', assume o seu
+// lugar e devolve 1 com os sockets de escuta herdados; senão devolve 0. O
+// processo anterior continua a aceitar conexões até confirmaServidor.
+int assumeServidor(const char *caminho) {
+    int fd = ligaAoControlo(caminho, "ASSUME");
+    if(fd < 0) return 0;
+
+    int sockets[MAX_SOCKETS_HERDADOS];
+    int n = recebeSockets(fd, sockets);
+    if(n < 0) {
+        fprintf(stderr, "O servidor em %s nao entregou os sockets\n", caminho);
+        exit(1);
+    }
+    socketClientes = sockets[0];
+    if(n > 1) socketReplicacao = sockets[1];
+
+    char linha[MAX_LINHA_PROTOCOLO];
+    Texto registos = { NULL, 0, 0, 0, 0 };
+    unsigned long long seq;
+    if(recebeLinha(fd, linha, sizeof(linha)) < 0 || sscanf(linha, "S %llu", &seq) != 1 ||
+       !recebeRegistos(fd, &registos, 0)) {
+        fprintf(stderr, "Snapshot do servidor anterior incompleto\n");
+        exit(1);
+    }
+    aplicaRegistos(&registos, 1);
+    textoLiberta(&registos);
+
+    int sessoes = 0, fim = 0;
+    time_t agora = time(NULL);
+    while(recebeLinha(fd, linha, sizeof(linha)) >= 0) {
+        char token[TAM_TOKEN + 1];
+        long idade;
+        int pos;
+
+        if(strcmp(linha, "F") == 0) {
+            fim = 1;
+            break;
+        }
+        if(sscanf(linha, "T %32s %ld %n", token, &idade, &pos) != 2 || strlen(token) != TAM_TOKEN) continue;
+
+        pthread_mutex_lock(&mutexDados);
+        User *u = encontraUsuarioPorLogin(linha + pos);
+        Handle id = u ? u->id : HANDLE_INVALIDO;
+        pthread_mutex_unlock(&mutexDados);
+
+        if(id != HANDLE_INVALIDO && insereSessao(token, id, agora - idade)) sessoes++;
+    }
+    if(!fim) {
+        fprintf(stderr, "Sessoes do servidor anterior incompletas\n");
+        exit(1);
+    }
+
+    pthread_mutex_lock(&mutexDados);
+    logAtivo = 1;
+    pthread_mutex_unlock(&mutexDados);
+    controloAnterior = fd;
+
+    printf("Servidor anterior substituido: %d sessoes herdadas.\n", sessoes);
+    return 1;
+}
+
+// Processo novo, pronto a aceitar conexões: confirma-o ao anterior, que só
+// então deixa de as aceitar, e passa a ser seguido por ele como uma réplica
+// até este fechar as suas conexões
+void confirmaServidor(void) {
+    if(controloAnterior < 0) return;
+    if(!enviaTudo(controloAnterior, "OK\n", 3)) {
+        // O anterior desistiu da entrega e continua a servir: dois servidores
+        // a aceitar mutações divergiam
+        fprintf(stderr, "O servidor anterior cancelou a entrega\n");
+        exit(1);
+    }
+    if(!acompanhaProcesso(controloAnterior)) {
+        // Ao perder a ligação o anterior volta a pedir para nos seguir
+        perror("Erro ao criar thread de replicacao");
+        close(controloAnterior);
+    }
+    controloAnterior = -1;
+}
+
+// --------------------------------------------------
+// Anexos dos desafios
+// --------------------------------------------------
+// Desenhos técnicos, fotografias e PDFs ficam em disco, em
+// <diretorioAnexos>/<nome do desafio em hexadecimal>/<nome do anexo>. O
+// próprio diretório serve de índice: os anexos sobrevivem a reinícios e não
+// pesam nos dados em memória nem no snapshot da replicação.
+//
+// Só a associação dona do desafio (o campo associacao do registo D) lhe
+// anexa ficheiros. Envia o ficheiro depois de indicar o tamanho; os bytes
+// passam do socket para o ficheiro por splice (via pipe), sem cópias para o
+// espaço do utilizador, e só ficam visíveis quando completos: cada envio
+// escreve num ficheiro temporário próprio (mkstemp) e é publicado por link,
+// que falha se o nome já existir, pelo que um anexo nunca é substituído nem
+// misturado com outro envio do mesmo nome. O download é feito por sendfile
+// e começa no byte pedido, para retomar uma transferência interrompida: o
+// servidor responde "ANEXO <nome> <inicio> <bytes>" e envia exatamente
+// esses bytes. As transferências não trancam mutexDados (só a
+// verificação do desafio) e cada uma ocupa apenas a thread da sua conexão.
+//
+// Os anexos não passam pela replicação: cada máquina guarda os que lhe foram
+// enviados. Com réplicas, -a deve apontar para um diretório partilhado por
+// todas (p.ex. NFS) ou os anexos devem ser enviados ao primário, para onde
+// a réplica encaminha os voluntários que não os encontram. A remoção
+// de um desafio, essa, chega a todas pelo log e apaga os anexos locais.
+
+#define MAX_NOME_ANEXO    64
+#define MAX_TAMANHO_ANEXO (64L * 1024 * 1024)
+#define BLOCO_ANEXO       (1024 * 1024)
+#define MAX_CAMINHO_ANEXO 1024
+
+const char *diretorioAnexos = "anexos";
+
+// Diretório dos anexos do desafio
+void caminhoAnexos(const char *desafio, char caminho[MAX_CAMINHO_ANEXO]) {
+    int n = snprintf(caminho, MAX_CAMINHO_ANEXO, "%s/", diretorioAnexos);
+    for(const unsigned char *c = (const unsigned char*)desafio; *c && n + 3 < MAX_CAMINHO_ANEXO; c++) {
+        n += snprintf(caminho + n, MAX_CAMINHO_ANEXO - n, "%02x", *c);
+    }
+}
+
+// Só letras, dígitos, '.', '-' e '_', sem começar por '.' (ficheiros parciais)
+int nomeAnexoValido(const char *nome) {
+    size_t len = strlen(nome);
+    if(len == 0 || len > MAX_NOME_ANEXO || nome[0] == '.') return 0;
+    for(size_t i = 0; i < len; i++) {
+        char c = nome[i];
+        if(!((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c >= '0' && c <= '9') ||
+             c == '.' || c == '-' || c == '_')) return 0;
+    }
+    return 1;
+}
+
+int desafioExiste(const char *nome) {
+    pthread_mutex_lock(&mutexDados);
+    int existe = encontraDesafio(nome) != NULL;
+    pthread_mutex_unlock(&mutexDados);
+    return existe;
+}
+
+// Só a associação dona do desafio lhe anexa ficheiros; devolve NULL ou a recusa
+const char* verificaDonoDesafio(const char *nome, Handle associacao) {
+    const char *recusa = NULL;
+
+    pthread_mutex_lock(&mutexDados);
+    const Challenge *c = encontraDesafio(nome);
+    const User *u = resolveUsuario(associacao);
+    if(!c) {
+        recusa = "Desafio não encontrado.\n";
+    } else if(!u || strcmp(c->associacao, loginUsuario(u)) != 0) {
+        recusa = "Só a associação que criou o desafio lhe pode anexar ficheiros.\n";
+    }
+    pthread_mutex_unlock(&mutexDados);
+    return recusa;
+}
+
+// Copia 'tamanho' bytes do cliente para fd: primeiro o que já está no buffer
+// de entrada, o resto por splice. Se a escrita em disco falhar, o resto é lido
+// e descartado para não ser tomado por opções do menu. Devolve 1 se tudo foi
+// escrito, 0 se o disco falhou e -1 se a conexão fechou.
+int copiaParaFicheiro(int sockfd, int fd, long tamanho) {
+    char pendente[TAM_BUFFER_ENTRADA];
+    size_t n = retiraDoBuffer(pendente, tamanho < (long)sizeof(pendente) ? (size_t)tamanho : sizeof(pendente));
+    int ok = write(fd, pendente, n) == (ssize_t)n;
+    tamanho -= n;
+
+    int tubo[2];
+    if(pipe(tubo) < 0) {
+        tubo[0] = tubo[1] = -1;
+        ok = 0;
+    }
+
+    while(tamanho > 0) {
+        ssize_t lidos;
+        if(ok && !conexaoNoAnel(sockfd)) {
+            lidos = splice(sockfd, NULL, tubo[1], NULL, tamanho < BLOCO_ANEXO ? tamanho : BLOCO_ANEXO,
+                           SPLICE_F_MOVE | SPLICE_F_MORE);
+            for(ssize_t resta = lidos; ok && resta > 0; ) {
+                ssize_t escritos = splice(tubo[0], NULL, fd, NULL, resta, SPLICE_F_MOVE);
+                if(escritos <= 0) ok = 0;
+                else resta -= escritos;
+            }
+        } else {
+            // Sem splice no anel: os bytes já chegam à fila da conexão
+            lidos = recebeCliente(sockfd, pendente, tamanho < (long)sizeof(pendente) ? (size_t)tamanho : sizeof(pendente));
+            if(ok && lidos > 0 && write(fd, pendente, lidos) != lidos) ok = 0;
+        }
+        if(lidos <= 0) {
+            ok = -1;
+            break;
+        }
+        tamanho -= lidos;
+    }
+
+    if(tubo[0] >= 0) {
+        close(tubo[0]);
+        close(tubo[1]);
+    }
+    return ok;
+}
+
+// Associação anexa um ficheiro a um desafio seu; devolve 0 se a conexão
+// fechou. Um anexo existente nunca é substituído: o nome tem de ser novo.
+int recebeAnexo(int sockfd, Handle associacao) {
+    char desafio[MAX_STR], nome[MAX_STR], buffer[MAX_STR * 2];
+    char diretorio[MAX_CAMINHO_ANEXO], parcial[MAX_CAMINHO_ANEXO + MAX_STR + 16], final[MAX_CAMINHO_ANEXO + MAX_STR];
+    const char *recusa;
+
+    enviaCliente(sockfd, "Nome do desafio: ", 17);
+    if(recebeLinha(sockfd, desafio, sizeof(desafio)) < 0) return 0;
+    if((recusa = verificaDonoDesafio(desafio, associacao)) != NULL) {
+        enviaCliente(sockfd, recusa, strlen(recusa));
+        return 1;
+    }
+
+    enviaCliente(sockfd, "Nome do ficheiro: ", 18);
+    if(recebeLinha(sockfd, nome, sizeof(nome)) < 0) return 0;
+    if(!nomeAnexoValido(nome)) {
+        enviaCliente(sockfd, "Nome invalido (use letras, digitos, '.', '-' e '_').\n", 53);
+        return 1;
+    }
+
+    caminhoAnexos(desafio, diretorio);
+    snprintf(parcial, sizeof(parcial), "%s/.%s.XXXXXX", diretorio, nome);
+    snprintf(final, sizeof(final), "%s/%s", diretorio, nome);
+    const char *existente = "Ja existe um anexo com esse nome neste desafio; escolha outro nome.\n";
+    if(access(final, F_OK) == 0) {
+        enviaCliente(sockfd, existente, strlen(existente));
+        return 1;
+    }
+
+    enviaCliente(sockfd, "Tamanho em bytes: ", 18);
+    if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) return 0;
+    long tamanho = atol(buffer);
+    if(tamanho <= 0 || tamanho > MAX_TAMANHO_ANEXO) {
+        snprintf(buffer, sizeof(buffer), "Tamanho invalido (maximo %ld bytes).\n", MAX_TAMANHO_ANEXO);
+        enviaCliente(sockfd, buffer, strlen(buffer));
+        return 1;
+    }
+
+    mkdir(diretorioAnexos, 0755);
+    mkdir(diretorio, 0755);
+
+    // Sem ficheiro os bytes são lidos e descartados por copiaParaFicheiro
+    int fd = mkstemp(parcial);
+    if(fd >= 0) fchmod(fd, 0644);
+
+    snprintf(buffer, sizeof(buffer), "Envie agora os %ld bytes do ficheiro.\n", tamanho);
+    enviaCliente(sockfd, buffer, strlen(buffer));
+
+    int ok = copiaParaFicheiro(sockfd, fd, tamanho);
+    if(fd >= 0) close(fd);
+    // link e não rename: falha em vez de substituir um anexo com o mesmo
+    // nome acabado de chegar por outra conexão
+    int ligado = -1, repetido = 0;
+    if(ok == 1 && fd >= 0) {
+        ligado = link(parcial, final);
+        repetido = ligado < 0 && errno == EEXIST;
+    }
+    if(fd >= 0) unlink(parcial);
+    if(ligado == 0) {
+        snprintf(buffer, sizeof(buffer), "Anexo %s guardado (%ld bytes).\n", nome, tamanho);
+        enviaCliente(sockfd, buffer, strlen(buffer));
+        return 1;
+    }
+    if(ok < 0) return 0;
+    if(repetido) enviaCliente(sockfd, existente, strlen(existente));
+    else enviaCliente(sockfd, "Erro ao guardar o anexo.\n", 25);
+    return 1;
+}
+
+// Lista os anexos do desafio; devolve quantos há
+int listaAnexos(int sockfd, const char *desafio) {
+    char diretorio[MAX_CAMINHO_ANEXO];
+    Texto t = { NULL, 0, 0, 0, 0 };
+    int num = 0;
+
+    caminhoAnexos(desafio, diretorio);
+    DIR *d = opendir(diretorio);
+    if(d) {
+        int dirfd = open(diretorio, O_RDONLY | O_DIRECTORY);
+        struct dirent *e;
+        while((e = readdir(d)) != NULL) {
+            struct stat st;
+            if(e->d_name[0] == '.' || fstatat(dirfd, e->d_name, &st, 0) < 0) continue;
+            if(num++ == 0) textoAcrescenta(&t, "\nAnexos do desafio:\n");
+            textoAcrescenta(&t, "  %s (%lld bytes)\n", e->d_name, (long long)st.st_size);
+        }
+        if(dirfd >= 0) close(dirfd);
+        closedir(d);
+    }
+    if(num == 0) textoAcrescenta(&t, "Este desafio nao tem anexos.\n");
+    textoEnvia(sockfd, &t);
+    return num;
+}
+
+// Voluntário descarrega um anexo, a partir do início ou de um byte dado;
+// devolve 0 se a conexão fechou
+int enviaAnexo(int sockfd) {
+    char desafio[MAX_STR], nome[MAX_STR], buffer[MAX_STR * 2];
+    char diretorio[MAX_CAMINHO_ANEXO], caminho[MAX_CAMINHO_ANEXO + MAX_STR];
+
+    enviaCliente(sockfd, "Nome do desafio: ", 17);
+    if(recebeLinha(sockfd, desafio, sizeof(desafio)) < 0) return 0;
+    if(!desafioExiste(desafio)) {
+        enviaCliente(sockfd, "Desafio não encontrado.\n", 25);
+        return 1;
+    }
+    if(listaAnexos(sockfd, desafio) == 0) {
+        // Os anexos não são replicados: na réplica só estão os que lhe foram
+        // enviados, os das associações estão no primário
+        if(modoReplicacao == REPLICA) {
+            snprintf(buffer, sizeof(buffer), "Este servidor e uma replica: procure os anexos "
+                     "no servidor primario (%s).\n", estadoReplica.host);
+            enviaCliente(sockfd, buffer, strlen(buffer));
+        }
+        return 1;
+    }
+
+    enviaCliente(sockfd, "Nome do anexo: ", 15);
+    if(recebeLinha(sockfd, nome, sizeof(nome)) < 0) return 0;
+
+    enviaCliente(sockfd, "Byte inicial (0, ou onde a transferencia parou): ", 49);
+    if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) return 0;
+    off_t inicio = atoll(buffer);
+
+    caminhoAnexos(desafio, diretorio);
+    snprintf(caminho, sizeof(caminho), "%s/%s", diretorio, nome);
+    struct stat st;
+    int fd = nomeAnexoValido(nome) ? open(caminho, O_RDONLY) : -1;
+    if(fd < 0 || fstat(fd, &st) < 0) {
+        if(fd >= 0) close(fd);
+        enviaCliente(sockfd, "Anexo não encontrado.\n", 23);
+        return 1;
+    }
+    if(inicio < 0 || inicio > st.st_size) {
+        close(fd);
+        enviaCliente(sockfd, "Byte inicial fora do ficheiro.\n", 31);
+        return 1;
+    }
+
+    snprintf(buffer, sizeof(buffer), "ANEXO %s %lld %lld\n",
+             nome, (long long)inicio, (long long)(st.st_size - inicio));
+    // O cabeçalho e o conteúdo vão direto ao socket, depois do que já está
+    // na fila da conexão (no anel)
+    esperaEnvios(sockfd);
+    int ok = enviaTudo(sockfd, buffer, strlen(buffer));
+
+    // Por blocos, para que o tamanho de cada chamada fique limitado
+    off_t pos = inicio;
+    while(ok && pos < st.st_size) {
+        size_t bloco = st.st_size - pos < BLOCO_ANEXO ? (size_t)(st.st_size - pos) : BLOCO_ANEXO;
+        ok = sendfile(sockfd, fd, &pos, bloco) > 0;
+    }
+    close(fd);
+    return ok;
+}
+
+// Apaga os anexos de um desafio removido
+void removeAnexos(const char *desafio) {
+    char diretorio[MAX_CAMINHO_ANEXO], caminho[MAX_CAMINHO_ANEXO + 300];
+
+    caminhoAnexos(desafio, diretorio);
+    DIR *d = opendir(diretorio);
+    if(!d) return;
+    struct dirent *e;
+    while((e = readdir(d)) != NULL) {
+        if(strcmp(e->d_name, ".") == 0 || strcmp(e->d_name, "..") == 0) continue;
+        snprintf(caminho, sizeof(caminho), "%s/%s", diretorio, e->d_name);
+        unlink(caminho);
+    }
+    closedir(d);
+    rmdir(diretorio);
+}
+
+// --------------------------------------------------
+// Menus
+// --------------------------------------------------
+// Os menus guardam o handle do usuário e não um ponteiro: se o administrador
+// o remover entretanto, a sessão termina em vez de usar memória libertada.
+
+// Confirma que o usuário da sessão ainda existe
+int usuarioAtivo(int sockfd, Handle id) {
+    pthread_mutex_lock(&mutexDados);
+    int ativo = resolveUsuario(id) != NULL;
+    pthread_mutex_unlock(&mutexDados);
+
+    if(!ativo) {
+        enviaCliente(sockfd, "Usuario removido. Sessao terminada.\n", 36);
+    }
+    return ativo;
+}
+
+// Menu para voluntário (engenheiro); devolve 1 se o usuário saiu pelo menu
+// e 0 se a conexão caiu
+int menuVoluntario(int sockfd, Handle id) {
+    char buffer[1024];
+
+    while(usuarioAtivo(sockfd, id)) {
         snprintf(buffer, sizeof(buffer),
                  "\n--- MENU VOLUNTARIO ---\n"
                  "1. Listar desafios disponiveis\n"
                  "2. Candidatar-se a um desafio\n"
                  "3. Ver minhas candidaturas\n"
+                 "4. Descarregar anexo de um desafio\n"
                  "0. Sair\n"
                  "Escolha: ");
-        send(sockfd, buffer, strlen(buffer), 0);
+        enviaCliente(sockfd, buffer, strlen(buffer));
 
-        int bytesRecv = recv(sockfd, buffer, sizeof(buffer), 0);
-        if(bytesRecv <= 0) {
-            sair = 1;
-            break;
+        if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) {
+            return 0;
         }
 
         int op = atoi(buffer);
@@ -382,230 +4290,524 @@ void menuVoluntario(int sockfd, User* u) {
                 break;
             case 2: {
                 // F7: Engenheiro se candidata a um desafio
+                if(!permiteAcao(sockfd, ACAO_CANDIDATURA)) break;
                 listaTodosDesafios(sockfd);
-                send(sockfd, "\nDigite o nome do desafio que deseja se candidatar: ", 51, 0);
-                recv(sockfd, buffer, sizeof(buffer), 0);
-                removeNewline(buffer);
+                enviaCliente(sockfd, "\nDigite o nome do desafio que deseja se candidatar: ", 51);
+                recebeLinha(sockfd, buffer, sizeof(buffer));
 
+                Texto t = { NULL, 0, 0, 0, 1 };
+                pthread_mutex_lock(&mutexDados);
                 Challenge *desafio = encontraDesafio(buffer);
-                if(desafio) {
-                    // Encontra a associação que criou o desafio
-                    User *aux = listaUsuarios;
-                    while(aux) {
-                        if(aux->userType == ASSOCIACAO) {
-                            insereCandidatura(desafio, u, aux);
-                            send(sockfd, "Candidatura enviada com sucesso!\n", 33, 0);
-                            break;
-                        }
-                        aux = aux->next;
+                User *u = resolveUsuario(id);
+                if(desafio && u) {
+                    // Encontra a associação que criou o desafio (nos desafios
+                    // sem dono, a primeira associação, como antes)
+                    User *aux;
+                    if(desafio->associacao[0]) {
+                        aux = encontraUsuarioPorLogin(desafio->associacao);
+                        if(aux && aux->userType != ASSOCIACAO) aux = NULL;
+                    } else {
+                        for(aux = listaUsuarios; aux && aux->userType != ASSOCIACAO; aux = aux->next);
                     }
+                    if(aux) {
+                        textoCampo(&t, "C", 0);
+                        textoCampo(&t, desafio->nomeDesafio, 0);
+                        textoCampo(&t, loginUsuario(u), 0);
+                        textoCampo(&t, loginUsuario(aux), 1);
+                    }
+                }
+                pthread_mutex_unlock(&mutexDados);
+
+                if(!desafio) {
+                    enviaCliente(sockfd, "Desafio não encontrado.\n", 25);
+                } else if(!t.usado) {
+                    const char *semDono = "A associação deste desafio já não existe.\n";
+                    enviaCliente(sockfd, semDono, strlen(semDono));
                 } else {
-                    send(sockfd, "Desafio não encontrado.\n", 25, 0);
+                    char erro[MAX_STR];
+                    if(executaMutacao(t.dados, erro)) {
+                        enviaCliente(sockfd, "Candidatura enviada com sucesso!\n", 33);
+                    } else {
+                        enviaErro(sockfd, erro);
+                    }
                 }
+                textoLiberta(&t);
                 break;
             }
             case 3:
                 // F9: Ver status das candidaturas
-                listaCandidaturasEngenheiro(sockfd, u);
+                listaCandidaturasEngenheiro(sockfd, id);
+                break;
+            case 4:
+                if(!enviaAnexo(sockfd)) return 0;
                 break;
             case 0:
             default:
-                sair = 1;
-                break;
+                return 1;
         }
     }
+    return 1;
 }
 
-// Menu para associação
-void menuAssociacao(int sockfd, User* u) {
+// Menu para associação; devolve 1 se o usuário saiu pelo menu e 0 se a conexão caiu
+int menuAssociacao(int sockfd, Handle id) {
     char buffer[1024];
-    int sair = 0;
 
-    while(!sair) {
+    while(usuarioAtivo(sockfd, id)) {
         snprintf(buffer, sizeof(buffer),
                  "\n--- MENU ASSOCIACAO ---\n"
                  "1. Adicionar Desafio\n"
                  "2. Listar Desafios\n"
                  "3. Gerenciar Candidaturas\n"
+                 "4. Anexar ficheiro a um desafio\n"
                  "0. Sair\n"
                  "Escolha: ");
-        send(sockfd, buffer, strlen(buffer), 0);
+        enviaCliente(sockfd, buffer, strlen(buffer));
 
-        int bytesRecv = recv(sockfd, buffer, sizeof(buffer), 0);
-        if(bytesRecv <= 0) {
-            sair = 1;
-            break;
+        if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) {
+            return 0;
         }
 
         int op = atoi(buffer);
         switch(op) {
             case 1: {
                 // F6: adicionar desafio
+                if(!aceitaRegistos(sockfd)) break;
                 Challenge *c = (Challenge*)malloc(sizeof(Challenge));
                 if(!c) break;
                 memset(c, 0, sizeof(Challenge));
 
-                send(sockfd, "Nome do desafio: ", 18, 0);
-                recv(sockfd, c->nomeDesafio, MAX_STR, 0);
-                removeNewline(c->nomeDesafio);
+                enviaCliente(sockfd, "Nome do desafio: ", 18);
+                recebeLinha(sockfd, c->nomeDesafio, MAX_STR);
 
-                send(sockfd, "Descricao do desafio: ", 23, 0);
-                recv(sockfd, c->descricao, MAX_STR, 0);
-                removeNewline(c->descricao);
+                enviaCliente(sockfd, "Descricao do desafio: ", 23);
+                recebeLinha(sockfd, c->descricao, MAX_STR);
 
-                send(sockfd, "Tipo de engenheiro necessario: ", 31, 0);
-                recv(sockfd, c->tipoEngenheiro, MAX_STR, 0);
-                removeNewline(c->tipoEngenheiro);
+                enviaCliente(sockfd, "Tipo de engenheiro necessario: ", 31);
+                recebeLinha(sockfd, c->tipoEngenheiro, MAX_STR);
 
-                send(sockfd, "Horas estimadas (numero): ", 26, 0);
-                recv(sockfd, buffer, 1024, 0);
-                removeNewline(buffer);
+                enviaCliente(sockfd, "Horas estimadas (numero): ", 26);
+                recebeLinha(sockfd, buffer, 1024);
                 c->horasEstimadas = atoi(buffer);
 
-                insereDesafio(c);
-                send(sockfd, "Desafio adicionado com sucesso!\n", 33, 0);
+                pthread_mutex_lock(&mutexDados);
+                User *u = resolveUsuario(id);
+                if(u) snprintf(c->associacao, MAX_STR, "%s", loginUsuario(u));
+                pthread_mutex_unlock(&mutexDados);
+
+                Texto t = { NULL, 0, 0, 0, 1 };
+                char erro[MAX_STR];
+                serializaDesafio(&t, c);
+                free(c);
+                int inserido = executaMutacao(t.dados, erro);
+                textoLiberta(&t);
+
+                if(!inserido) {
+                    enviaErro(sockfd, erro);
+                    break;
+                }
+                enviaCliente(sockfd, "Desafio adicionado com sucesso!\n", 33);
                 break;
             }
             case 2:
                 listaTodosDesafios(sockfd);
                 break;
             case 3: {
-                // F8: Gerenciar candidaturas
+                // F8: Gerenciar candidaturas, em lote: uma página numerada,
+                // uma linha de decisões e uma mensagem comum a todas
+                ItemRevisao *itens;
+                int num = listaCandidaturasAssociacao(sockfd, id, &itens);
+                if(num == 0) {
+                    free(itens);
+                    break;
+                }
+
+                enviaCliente(sockfd, "\nDecisoes (ex.: aceitar 1,3,7 rejeitar 2), ou 0 para voltar: ", 61);
+                if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) {
+                    free(itens);
+                    return 0;
+                }
+                if(strcmp(buffer, "0") == 0) {
+                    free(itens);
+                    break;
+                }
+
+                int *decisoes = (int*)calloc(num, sizeof(int));
+                int total = decisoes ? interpretaDecisoes(buffer, num, decisoes) : -1;
+                if(total <= 0) {
+                    enviaCliente(sockfd, "Decisoes invalidas.\n", 20);
+                    free(decisoes);
+                    free(itens);
+                    break;
+                }
+
                 char mensagem[MAX_STR];
-                listaCandidaturasAssociacao(sockfd, u);
-                
-                send(sockfd, "\nDigite o nome do desafio para processar (ou 0 para voltar): ", 60, 0);
-                recv(sockfd, buffer, sizeof(buffer), 0);
-                removeNewline(buffer);
+                enviaCliente(sockfd, "Mensagem para os candidatos: ", 29);
+                if(recebeLinha(sockfd, mensagem, MAX_STR) < 0) {
+                    free(decisoes);
+                    free(itens);
+                    return 0;
+                }
+
+                char login[MAX_STR];
+                pthread_mutex_lock(&mutexDados);
+                User *u = resolveUsuario(id);
+                snprintf(login, sizeof(login), "%s", u ? loginUsuario(u) : "");
+                pthread_mutex_unlock(&mutexDados);
+
+                Texto t = { NULL, 0, 0, 0, 1 };
+                for(int i = 0; i < num; i++) {
+                    if(!decisoes[i]) continue;
+                    textoCampo(&t, "P", 0);
+                    textoCampo(&t, itens[i].desafio, 0);
+                    textoCampo(&t, itens[i].engenheiro, 0);
+                    textoCampo(&t, login, 0);
+                    textoCampo(&t, decisoes[i] == 1 ? "1" : "2", 0);
+                    textoCampo(&t, mensagem, 1);
+                }
+
+                // Todas ou nenhuma: se alguma já foi decidida entretanto, nada muda
+                char erro[MAX_STR];
+                if(executaLote(t.dados, total, erro)) {
+                    snprintf(buffer, sizeof(buffer), "%d candidatura(s) processada(s) com sucesso!\n", total);
+                    enviaCliente(sockfd, buffer, strlen(buffer));
+                } else {
+                    enviaErro(sockfd, erro);
+                    enviaCliente(sockfd, "Nenhuma decisao foi aplicada.\n", 30);
+                }
+                textoLiberta(&t);
+                free(decisoes);
+                free(itens);
+                break;
+            }
+            case 4:
+                if(!recebeAnexo(sockfd, id)) return 0;
+                break;
+            case 0:
+            default:
+                return 1;
+        }
+    }
+    return 1;
+}
+
+#define TOP_MEMORIA 5
+
+// Acrescenta "<n> KiB" (ou MiB, acima de 10 MiB) a um texto
+void textoBytes(Texto *t, long long bytes) {
+    if(bytes >= 10LL * 1024 * 1024) textoAcrescenta(t, "%.1f MiB", bytes / (1024.0 * 1024.0));
+    else textoAcrescenta(t, "%.1f KiB", bytes / 1024.0);
+}
+
+// Relatório de memória para o administrador: reservatórios, médias e maiores usuários
+void mostraMemoria(int sockfd) {
+    Texto t = { NULL, 0, 0, 0, 0 };
+    User *maiores[TOP_MEMORIA] = { NULL };
+
+    pthread_mutex_lock(&mutexConexoes);
+    int conexoes = conexoesAtivas;
+    pthread_mutex_unlock(&mutexConexoes);
+
+    pthread_mutex_lock(&mutexDados);
+    textoAcrescenta(&t, "--- Uso de memoria ---\n");
+    for(int r = 0; r < NUM_RESERVATORIOS; r++) {
+        textoAcrescenta(&t, "%-22s ", nomesReservatorios[r]);
+        textoBytes(&t, __atomic_load_n(&memoriaReservatorios[r], __ATOMIC_RELAXED));
+        textoAcrescenta(&t, "\n");
+    }
+    textoAcrescenta(&t, "%-22s ", "Total");
+    textoBytes(&t, memoriaTotal());
+    textoAcrescenta(&t, " de ");
+    textoBytes(&t, orcamentoGlobal);
+    textoAcrescenta(&t, "%s\n", memoriaEsgotada() ? " (ESGOTADO: novos registos recusados)" : "");
+
+    long long usuarios = indiceLogins.numEntradas;
+    long long candidaturas = memoriaReservatorios[MEM_CANDIDATURAS] / (long long)sizeof(Application);
+    textoAcrescenta(&t, "\n%lld usuario(s), %u desafio(s), %lld candidatura(s)\n",
+                    usuarios, indiceDesafios.numEntradas, candidaturas);
+    if(usuarios > 0) {
+        textoAcrescenta(&t, "Media por usuario: ");
+        textoBytes(&t, (memoriaReservatorios[MEM_USUARIOS] + memoriaReservatorios[MEM_CANDIDATURAS]) / usuarios);
+        textoAcrescenta(&t, " (orcamento ");
+        textoBytes(&t, orcamentoUsuario);
+        textoAcrescenta(&t, ")\n");
+    }
+
+    textoAcrescenta(&t, "%d conexao(oes) ativa(s)", conexoes);
+    if(conexoes > 0) {
+        textoAcrescenta(&t, ", media ");
+        textoBytes(&t, (memoriaReservatorios[MEM_ENTRADA] + memoriaReservatorios[MEM_SAIDA]) / conexoes);
+    }
+    textoAcrescenta(&t, ", pico ");
+    textoBytes(&t, __atomic_load_n(&picoConexao, __ATOMIC_RELAXED));
+    textoAcrescenta(&t, " (orcamento ");
+    textoBytes(&t, orcamentoConexao);
+    textoAcrescenta(&t, ")\n");
+
+    // Inserção ordenada nos maiores: a lista é percorrida uma só vez
+    for(User *u = listaUsuarios; u; u = u->next) {
+        int i = TOP_MEMORIA;
+        while(i > 0 && (!maiores[i - 1] || maiores[i - 1]->memoria < u->memoria)) {
+            if(i < TOP_MEMORIA) maiores[i] = maiores[i - 1];
+            i--;
+        }
+        if(i < TOP_MEMORIA) maiores[i] = u;
+    }
+    textoAcrescenta(&t, "\nMaiores usuarios:\n");
+    for(int i = 0; i < TOP_MEMORIA && maiores[i]; i++) {
+        textoAcrescenta(&t, "  %-20s ", loginUsuario(maiores[i]));
+        textoBytes(&t, maiores[i]->memoria);
+        textoAcrescenta(&t, "\n");
+    }
+    pthread_mutex_unlock(&mutexDados);
 
-                if(strcmp(buffer, "0") == 0) break;
+    textoEnvia(sockfd, &t);
+}
 
-                Challenge *desafio = encontraDesafio(buffer);
-                if(!desafio) {
-                    send(sockfd, "Desafio não encontrado.\n", 25, 0);
-                    break;
-                }
+// Importação pela conexão do administrador: os registos (CSV ou NDJSON, ver
+// "Importação e exportação em massa") chegam um por linha até uma linha
+// ".". Cada bloco é processado assim que fica cheio e os erros desse bloco
+// ("linha N: erro") são enviados logo, enquanto o resto ainda chega.
+// Devolve 0 se a conexão caiu.
+int importaDaConexao(int sockfd) {
+    if(modoReplicacao == REPLICA) {
+        enviaCliente(sockfd, "A importacao so pode ser feita no servidor primario.\n", 53);
+        return 1;
+    }
 
-                // Encontra a candidatura
-                Application *aux = listaCandidaturas;
-                while(aux) {
-                    if(aux->desafio == desafio && aux->associacao == u && aux->status == 0) {
-                        send(sockfd, "Aceitar candidatura? (1: Sim, 2: Não): ", 39, 0);
-                        recv(sockfd, buffer, sizeof(buffer), 0);
-                        removeNewline(buffer);
-                        int aceitar = atoi(buffer) == 1;
-
-                        send(sockfd, "Mensagem para o candidato: ", 27, 0);
-                        recv(sockfd, mensagem, MAX_STR, 0);
-                        removeNewline(mensagem);
-
-                        processaCandidatura(aux, aceitar, mensagem);
-                        send(sockfd, "Candidatura processada com sucesso!\n", 36, 0);
-                        break;
-                    }
-                    aux = aux->next;
-                }
-                break;
+    BlocoImportacao bloco;
+    if(!iniciaBloco(&bloco, NUM_THREADS_AUTH, aplicaBlocoMutacoes, "linha ")) {
+        enviaErro(sockfd, "sem memoria");
+        return 1;
+    }
+    enviaCliente(sockfd, "Envie os registos (CSV ou NDJSON, um por linha) e termine com uma linha '.':\n", 77);
+
+    char linha[MAX_LINHA_IMPORTACAO + 1];
+    long numLinha = 0;
+    int ligada = 1, fim = 0;
+
+    while(!fim) {
+        int len = recebeLinha(sockfd, linha, sizeof(linha));
+        ligada = len >= 0;
+        fim = !ligada || strcmp(linha, ".") == 0;
+        if(!fim) {
+            numLinha++;
+            if(len == MAX_LINHA_IMPORTACAO) {
+                erroImportacao(&bloco, numLinha, "linha demasiado longa");
+                continue;
             }
-            case 0:
-            default:
-                sair = 1;
-                break;
+            if(!acrescentaAoBloco(&bloco, linha, numLinha)) continue;
         }
+        processaBloco(&bloco);
+        if(ligada) textoDespeja(sockfd, &bloco.relatorio);
+    }
+
+    if(ligada) {
+        textoAcrescenta(&bloco.relatorio, "Importacao: %ld registos importados, %ld com erro.\n",
+                        bloco.importados, bloco.erros);
+        textoDespeja(sockfd, &bloco.relatorio);
     }
+    libertaBloco(&bloco);
+    return ligada;
 }
 
-// Menu para administrador (F5)
-void menuAdmin(int sockfd, User* u) {
+// Menu para administrador (F5); devolve 1 se saiu pelo menu e 0 se a conexão caiu
+int menuAdmin(int sockfd, Handle id) {
     char buffer[1024];
-    int sair = 0;
 
-    while(!sair) {
+    while(usuarioAtivo(sockfd, id)) {
         snprintf(buffer, sizeof(buffer),
                  "\n--- MENU ADMINISTRADOR ---\n"
                  "1. (Futuro) Validar cadastro de usuarios\n"
-                 "2. (Futuro) Remover usuarios\n"
+                 "2. Remover usuario\n"
+                 "3. Remover desafio\n"
+                 "4. Exportar dados (CSV ou NDJSON)\n"
+                 "5. Estado da replicacao\n"
+                 "6. Uso de memoria\n"
+                 "7. Importar dados (CSV ou NDJSON)\n"
                  "0. Sair\n"
                  "Escolha: ");
-        send(sockfd, buffer, strlen(buffer), 0);
+        enviaCliente(sockfd, buffer, strlen(buffer));
 
-        int bytesRecv = recv(sockfd, buffer, sizeof(buffer), 0);
-        if(bytesRecv <= 0) {
-            sair = 1;
-            break;
+        if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) {
+            return 0;
         }
 
         int op = atoi(buffer);
         switch(op) {
             case 1:
                 // Exemplo de funcionalidade futura
-                send(sockfd, "Funcionalidade de validacao ainda nao implementada.\n", 54, 0);
+                enviaCliente(sockfd, "Funcionalidade de validacao ainda nao implementada.\n", 54);
                 break;
-            case 2:
-                // Exemplo de funcionalidade futura
-                send(sockfd, "Funcionalidade de remocao ainda nao implementada.\n", 51, 0);
+            case 2: {
+                enviaCliente(sockfd, "Login do usuario a remover: ", 28);
+                recebeLinha(sockfd, buffer, sizeof(buffer));
+
+                Texto t = { NULL, 0, 0, 0, 1 };
+                char erro[MAX_STR];
+                textoCampo(&t, "RU", 0);
+                textoCampo(&t, buffer, 1);
+                int removido = executaMutacao(t.dados, erro);
+                textoLiberta(&t);
+
+                if(!removido) {
+                    enviaErro(sockfd, erro);
+                    break;
+                }
+                enviaCliente(sockfd, "Usuario removido com sucesso!\n", 30);
+                break;
+            }
+            case 3: {
+                enviaCliente(sockfd, "Nome do desafio a remover: ", 27);
+                recebeLinha(sockfd, buffer, sizeof(buffer));
+
+                Texto t = { NULL, 0, 0, 0, 1 };
+                char erro[MAX_STR];
+                textoCampo(&t, "RD", 0);
+                textoCampo(&t, buffer, 1);
+                int removido = executaMutacao(t.dados, erro);
+                textoLiberta(&t);
+
+                if(!removido) {
+                    enviaErro(sockfd, erro);
+                    break;
+                }
+                enviaCliente(sockfd, "Desafio removido com sucesso!\n", 30);
+                break;
+            }
+            case 4:
+                enviaCliente(sockfd, "Formato (1 - CSV, 2 - NDJSON): ", 31);
+                if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) return 0;
+                exportaDados(sockfd, atoi(buffer) == 2);
+                break;
+            case 5:
+                mostraReplicacao(sockfd);
+                break;
+            case 6:
+                mostraMemoria(sockfd);
+                break;
+            case 7:
+                if(!importaDaConexao(sockfd)) return 0;
                 break;
             case 0:
             default:
-                sair = 1;
-                break;
+                return 1;
         }
     }
+    return 1;
+}
+
+// Encaminha para o menu do tipo de usuário; devolve 1 se saiu pelo menu
+int menuUsuario(int sockfd, Handle id, UserType tipo) {
+    if(tipo == VOLUNTARIO) {
+        return menuVoluntario(sockfd, id);
+    } else if(tipo == ASSOCIACAO) {
+        return menuAssociacao(sockfd, id);
+    }
+    return menuAdmin(sockfd, id);
 }
 
+#define ESPERA_TOKEN_MS 50
+
 // Função que envia o menu inicial para o cliente e gerencia login/registro
 void menuInicial(int sockfd) {
     char buffer[1024];
+    char token[TAM_TOKEN + 1];
     int sair = 0;
 
+    // Quem retoma uma sessão envia "TOKEN <token>" logo ao ligar: se chegar
+    // dentro de ESPERA_TOKEN_MS vai direto ao menu do usuário, sem passar
+    // pelo menu inicial
+    int mostraMenu = !entradaComecaPor(sockfd, "TOKEN ", ESPERA_TOKEN_MS);
+
     while(!sair) {
-        snprintf(buffer, sizeof(buffer),
-                 "\n=== BEM-VINDO AO ESF (Engenheiros Sem Fronteiras) ===\n"
-                 "1. Login\n"
-                 "2. Cadastrar-se como Voluntario\n"
-                 "3. Cadastrar-se como Associacao\n"
-                 "0. Sair\n"
-                 "Escolha: ");
-        send(sockfd, buffer, strlen(buffer), 0);
+        if(mostraMenu) {
+            snprintf(buffer, sizeof(buffer),
+                     "\n=== BEM-VINDO AO ESF (Engenheiros Sem Fronteiras) ===\n"
+                     "1. Login\n"
+                     "2. Cadastrar-se como Voluntario\n"
+                     "3. Cadastrar-se como Associacao\n"
+                     "0. Sair\n"
+                     "Escolha: ");
+            enviaCliente(sockfd, buffer, strlen(buffer));
+        }
+        mostraMenu = 1;
 
-        int bytesRecv = recv(sockfd, buffer, sizeof(buffer), 0);
-        if(bytesRecv <= 0) {
+        if(recebeLinha(sockfd, buffer, sizeof(buffer)) < 0) {
             break;
         }
 
+        // Retoma de sessão: "TOKEN <token>" dispensa o login
+        if(strncmp(buffer, "TOKEN ", 6) == 0) {
+            if(strlen(buffer + 6) != TAM_TOKEN) {
+                enviaCliente(sockfd, "Sessao invalida ou expirada.\n", 29);
+                continue;
+            }
+            memcpy(token, buffer + 6, TAM_TOKEN + 1);
+
+            Handle id = retomaSessao(token);
+            pthread_mutex_lock(&mutexDados);
+            User *u = resolveUsuario(id);
+            UserType tipo = u ? u->userType : VOLUNTARIO;
+            pthread_mutex_unlock(&mutexDados);
+
+            if(!u) {
+                enviaCliente(sockfd, "Sessao invalida ou expirada.\n", 29);
+                continue;
+            }
+            if(menuUsuario(sockfd, id, tipo)) terminaSessao(token);
+            continue;
+        }
+
         int op = atoi(buffer);
         switch(op) {
             case 1: {
                 // Fazer login
                 char login[MAX_STR], senha[MAX_STR];
-                send(sockfd, "Login: ", 7, 0);
-                recv(sockfd, login, MAX_STR, 0);
-                removeNewline(login);
-
-                send(sockfd, "Senha: ", 7, 0);
-                recv(sockfd, senha, MAX_STR, 0);
-                removeNewline(senha);
-
-                User* userLogado = encontraUsuario(login, senha);
-                if(userLogado) {
-                    // Se for do tipo
-                    if(userLogado->userType == VOLUNTARIO) {
-                        menuVoluntario(sockfd, userLogado);
-                    } else if(userLogado->userType == ASSOCIACAO) {
-                        menuAssociacao(sockfd, userLogado);
-                    } else if(userLogado->userType == ADMIN) {
-                        menuAdmin(sockfd, userLogado);
-                    }
+                enviaCliente(sockfd, "Login: ", 7);
+                recebeLinha(sockfd, login, MAX_STR);
+
+                enviaCliente(sockfd, "Senha: ", 7);
+                recebeLinha(sockfd, senha, MAX_STR);
+                if(!permiteAcao(sockfd, ACAO_LOGIN)) break;
+
+                // Copia o hash com o mutex trancado; a verificação corre no pool
+                char hashGuardado[MAX_STR];
+                pthread_mutex_lock(&mutexDados);
+                User* userLogado = encontraUsuarioPorLogin(login);
+                Handle id = userLogado ? userLogado->id : HANDLE_INVALIDO;
+                UserType tipo = userLogado ? userLogado->userType : VOLUNTARIO;
+                if(userLogado) strcpy(hashGuardado, senhaUsuario(userLogado));
+                pthread_mutex_unlock(&mutexDados);
+
+                int verificacao = verificaSenha(senha, id == HANDLE_INVALIDO ? NULL : hashGuardado);
+                if(verificacao == SENHA_OCUPADO) {
+                    enviaCliente(sockfd, "Servidor ocupado, tente novamente.\n", 35);
+                    break;
+                }
+                if(verificacao != SENHA_CORRETA) {
+                    enviaCliente(sockfd, "Login ou senha invalidos.\n", 27);
+                    break;
+                }
+
+                if(criaSessao(id, token)) {
+                    snprintf(buffer, sizeof(buffer),
+                             "Token de sessao: %s\n"
+                             "(ao reconectar envie \"TOKEN %s\" para voltar a este menu)\n",
+                             token, token);
+                    enviaCliente(sockfd, buffer, strlen(buffer));
                 } else {
-                    send(sockfd, "Login ou senha invalidos.\n", 27, 0);
+                    token[0] = 0;
                 }
+
+                if(menuUsuario(sockfd, id, tipo) && token[0]) terminaSessao(token);
                 break;
             }
             case 2:
-                cadastrarVoluntario(sockfd);
+                if(permiteAcao(sockfd, ACAO_CADASTRO) && aceitaRegistos(sockfd)) cadastrarVoluntario(sockfd);
                 break;
             case 3:
-                cadastrarAssociacao(sockfd);
+                if(permiteAcao(sockfd, ACAO_CADASTRO) && aceitaRegistos(sockfd)) cadastrarAssociacao(sockfd);
                 break;
             case 0:
             default:
@@ -615,45 +4817,721 @@ void menuInicial(int sockfd) {
     }
 }
 
+// Conexão admitida, entregue à thread que a atende; fica em listaConexoes
+// (mutexConexoes) enquanto a thread a atender
+typedef struct ConexaoCliente {
+    int sockfd;
+    uint32_t ip;
+    ConexaoAnel *anel; // NULL sem io_uring
+    struct ConexaoCliente *prev;
+    struct ConexaoCliente *next;
+} ConexaoCliente;
+
+ConexaoCliente *listaConexoes = NULL;
+
+// Tira a conexão de listaConexoes (mutexConexoes trancado)
+void retiraConexao(ConexaoCliente *c) {
+    if(c->prev) c->prev->next = c->next;
+    else listaConexoes = c->next;
+    if(c->next) c->next->prev = c->prev;
+}
+
+// Termina todas as conexões em curso: as threads saem do recv e fecham-nas
+void terminaConexoes(void) {
+    pthread_mutex_lock(&mutexConexoes);
+    for(ConexaoCliente *c = listaConexoes; c; c = c->next) shutdown(c->sockfd, SHUT_RDWR);
+    pthread_mutex_unlock(&mutexConexoes);
+}
+
+// Thread que atende uma conexão
+void* atendeCliente(void *arg) {
+    ConexaoCliente *conexao = (ConexaoCliente*)arg;
+    int sockfd = conexao->sockfd;
+    ipCliente = conexao->ip;
+    conexaoAnel = conexao->anel;
+
+    // O buffer de entrada é fixo por thread; conta-se enquanto a conexão vive
+    memoriaConexao = 0;
+    contaMemoria(MEM_ENTRADA, sizeof(BufferEntrada) + sizeof(ConexaoCliente));
+
+    // Envia menu inicial
+    menuInicial(sockfd);
+
+    // Sai da lista antes do close, para que terminaConexoes não apanhe um
+    // descritor já reutilizado
+    pthread_mutex_lock(&mutexConexoes);
+    retiraConexao(conexao);
+    pthread_mutex_unlock(&mutexConexoes);
+    free(conexao);
+
+    if(conexaoAnel) largaConexaoAnel();
+    else close(sockfd);
+    libertaConexao(ipCliente);
+    contaMemoria(MEM_ENTRADA, -(long long)(sizeof(BufferEntrada) + sizeof(ConexaoCliente)));
+    memoriaConexao = -1;
+
+    pthread_mutex_lock(&mutexConexoes);
+    conexoesAtivas--;
+    pthread_cond_broadcast(&conexoesMudaram);
+    pthread_mutex_unlock(&mutexConexoes);
+    return NULL;
+}
+
+// Admite a conexão aceite em sockfd e entrega-a a uma thread nova; com o
+// anel, 'anel' é o estado da conexão no anel. Devolve 0 (com o socket já
+// fechado) se foi recusada ou não houve recursos para a atender.
+int despachaConexao(int sockfd, int newsockfd, uint32_t ip, ConexaoAnel *anel) {
+    // Recusa barata: uma linha sem bloquear e o fecho, sem thread nem sessão
+    const char *recusa = admiteConexao(sockfd, ip);
+    if(recusa) {
+        send(newsockfd, recusa, strlen(recusa), MSG_DONTWAIT);
+        close(newsockfd);
+        return 0;
+    }
+
+    // Cada resposta é um prompt à espera do cliente: sem Nagle, para que
+    // uma mensagem seguida do menu não fique retida pelo ACK atrasado
+    int um = 1;
+    setsockopt(newsockfd, IPPROTO_TCP, TCP_NODELAY, &um, sizeof(um));
+
+    // Processa conexão numa thread: os dados (e as sessões) são partilhados
+    // por todas as conexões, ao contrário de um processo filho por fork
+    ConexaoCliente *conexao = (ConexaoCliente*)calloc(1, sizeof(ConexaoCliente));
+    if(!conexao) {
+        perror("Erro de memoria");
+        close(newsockfd);
+        libertaConexao(ip);
+        return 0;
+    }
+    conexao->sockfd = newsockfd;
+    conexao->ip = ip;
+    conexao->anel = anel;
+
+    pthread_mutex_lock(&mutexConexoes);
+    conexoesAtivas++;
+    conexao->next = listaConexoes;
+    if(listaConexoes) listaConexoes->prev = conexao;
+    listaConexoes = conexao;
+    pthread_mutex_unlock(&mutexConexoes);
+
+    pthread_t thread;
+    if(pthread_create(&thread, NULL, atendeCliente, conexao) != 0) {
+        perror("Erro ao criar thread");
+        pthread_mutex_lock(&mutexConexoes);
+        retiraConexao(conexao);
+        conexoesAtivas--;
+        pthread_mutex_unlock(&mutexConexoes);
+        free(conexao);
+        close(newsockfd);
+        libertaConexao(ip);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+// --------------------------------------------------
+// Backend io_uring (-e uring)
+// --------------------------------------------------
+// Alternativa ao accept em poll e ao recv/send bloqueantes de cada thread.
+// Uma única thread (cicloAnel) serve o anel:
+//   - um accept multishot no socket de escuta entrega todas as conexões
+//     novas, sem uma chamada accept por conexão;
+//   - cada conexão tem um recv com IOSQE_BUFFER_SELECT: o kernel escolhe um
+//     buffer do anel de buffers registado (IORING_REGISTER_PBUF_RING), os
+//     bytes são copiados para a fila da conexão e o buffer volta logo ao anel;
+//   - os envios acumulados numa conexão saem como uma cadeia de sends
+//     ligados (IOSQE_IO_LINK), que o kernel executa por ordem;
+//   - cada volta do ciclo submete todas as SQEs preparadas e espera pelas
+//     CQEs numa só chamada io_uring_enter, e depois trata todas as que houver.
+// Os menus continuam numa thread por conexão (ver "Envio e receção nas
+// conexões de clientes"), acordada pelo anel quando chegam dados. O anel é
+// usado diretamente pelas chamadas ao sistema, sem liburing. Se o kernel não
+// o suportar (io_uring_setup ou o registo do anel de buffers falham, p.ex.
+// antes do 5.19 ou com io_uring desativado) o servidor usa as threads.
+
+#define ENTRADAS_ANEL       256
+#define ENTRADAS_CQ_ANEL    65536 // ver reservaSqes
+#define NUM_BUFFERS_ANEL    256  // potência de 2
+#define TAM_BUFFER_ANEL     4096
+#define GRUPO_BUFFERS_ANEL  0
+#define MAX_CADEIA_ENVIO    32   // sends ligados por cadeia
+
+// Tipo de operação nos 3 bits baixos do user_data (o resto é o ponteiro)
+enum {
+    OP_ACEITA = 1,
+    OP_RECEBE,
+    OP_ENVIA,
+    OP_ACORDA,
+    OP_PARAGEM,
+    OP_CANCELA
+};
+#define MASCARA_OP 7
+
+typedef struct AnelES {
+    int fd;
+    unsigned entradasSq;
+    unsigned *sqCabeca, *sqCauda, sqMascara;
+    unsigned sqLocal;    // cauda das SQEs preparadas (publicada ao submeter)
+    unsigned pendentes;  // SQEs preparadas e ainda não submetidas
+    struct io_uring_sqe *sqes;
+    unsigned *cqCabeca, *cqCauda, cqMascara;
+    struct io_uring_cqe *cqes;
+
+    struct io_uring_buf_ring *buffers;
+    char *memoriaBuffers;
+    unsigned short caudaBuffers;
+
+    int socketEscuta;
+    int aceitaAtivo;     // accept multishot armado
+    int aParar;          // pipeParagem: não se aceitam mais conexões
+    uint64_t acordado;   // destino do read do eventfd
+} AnelES;
+
+AnelES anel = { .fd = -1 };
+
+int entraAnel(unsigned minimo) {
+    __atomic_store_n(anel.sqCauda, anel.sqLocal, __ATOMIC_RELEASE);
+    int r;
+    do {
+        r = (int)syscall(__NR_io_uring_enter, anel.fd, anel.pendentes, minimo,
+                         minimo ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+    } while(r < 0 && errno == EINTR);
+    if(r > 0) anel.pendentes -= (unsigned)r;
+    return r;
+}
+
+// Garante n SQEs livres, submetendo as preparadas se for preciso. A CQ tem
+// lugar para todas as operações que podem estar em curso (MAX_CONEXOES vezes
+// um recv e uma cadeia de envios, mais a fila do listen), por isso nunca
+// transborda e a submissão não fica à espera de CQEs por tratar.
+void reservaSqes(unsigned n) {
+    while(anel.entradasSq - (anel.sqLocal - __atomic_load_n(anel.sqCabeca, __ATOMIC_ACQUIRE)) < n) {
+        if(entraAnel(0) < 0 && errno != EAGAIN) {
+            perror("Erro no io_uring_enter");
+            exit(1);
+        }
+    }
+}
+
+struct io_uring_sqe* preparaSqe(uint8_t opcode, int fd, void *ptr, int op) {
+    reservaSqes(1);
+    struct io_uring_sqe *sqe = &anel.sqes[anel.sqLocal & anel.sqMascara];
+    memset(sqe, 0, sizeof(*sqe));
+    sqe->opcode = opcode;
+    sqe->fd = fd;
+    sqe->user_data = (uint64_t)(uintptr_t)ptr | (uint64_t)op;
+    anel.sqLocal++;
+    anel.pendentes++;
+    return sqe;
+}
+
+void armaAceita(void) {
+    struct io_uring_sqe *sqe = preparaSqe(IORING_OP_ACCEPT, anel.socketEscuta, NULL, OP_ACEITA);
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    anel.aceitaAtivo = 1;
+}
+
+void armaAcorda(void) {
+    struct io_uring_sqe *sqe = preparaSqe(IORING_OP_READ, acordaAnelFd, NULL, OP_ACORDA);
+    sqe->addr = (uint64_t)(uintptr_t)&anel.acordado;
+    sqe->len = sizeof(anel.acordado);
+}
+
+void armaParagem(void) {
+    struct io_uring_sqe *sqe = preparaSqe(IORING_OP_POLL_ADD, pipeParagem[0], NULL, OP_PARAGEM);
+    sqe->poll32_events = POLLIN;
+}
+
+// Recv com o buffer escolhido pelo kernel do grupo registado (c->mutex trancado)
+void armaRecebe(ConexaoAnel *c) {
+    struct io_uring_sqe *sqe = preparaSqe(IORING_OP_RECV, c->fd, c, OP_RECEBE);
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = GRUPO_BUFFERS_ANEL;
+    sqe->len = TAM_BUFFER_ANEL;
+    c->recebeAtivo = 1;
+}
+
+// Submete a fila de envios como uma cadeia de sends ligados: se um falhar
+// ou ficar a meio, os seguintes são cancelados e voltam a sair na próxima
+// cadeia, a partir do byte onde ficaram (c->mutex trancado)
+void submeteEnvios(ConexaoAnel *c) {
+    int n = 0;
+    for(EnvioAnel *e = c->envios; e && n < MAX_CADEIA_ENVIO; e = e->next) n++;
+    if(!n) return;
+
+    reservaSqes(n); // a cadeia não pode ser partida entre duas submissões
+    EnvioAnel *e = c->envios;
+    for(int i = 0; i < n; i++, e = e->next) {
+        struct io_uring_sqe *sqe = preparaSqe(IORING_OP_SEND, c->fd, e, OP_ENVIA);
+        sqe->addr = (uint64_t)(uintptr_t)(e->dados + e->enviado);
+        sqe->len = (unsigned)(e->tamanho - e->enviado);
+        // MSG_WAITALL: um envio parcial é retomado pelo kernel em vez de
+        // deixar o seguinte da cadeia sair antes do resto
+        sqe->msg_flags = MSG_WAITALL | MSG_NOSIGNAL;
+        if(i + 1 < n) sqe->flags = IOSQE_IO_LINK;
+        e->submetido = 1;
+    }
+    c->emCurso = n;
+}
+
+void devolveBuffer(unsigned short bid) {
+    struct io_uring_buf *b = &anel.buffers->bufs[anel.caudaBuffers & (NUM_BUFFERS_ANEL - 1)];
+    b->addr = (uint64_t)(uintptr_t)(anel.memoriaBuffers + (size_t)bid * TAM_BUFFER_ANEL);
+    b->len = TAM_BUFFER_ANEL;
+    b->bid = bid;
+    anel.caudaBuffers++;
+    __atomic_store_n(&anel.buffers->tail, anel.caudaBuffers, __ATOMIC_RELEASE);
+}
+
+// Fecha e liberta a conexão largada pela thread quando o anel já não tem
+// operações sobre ela
+void libertaSeLivre(ConexaoAnel *c) {
+    if(!c->largada || c->recebeAtivo || c->emCurso) return;
+
+    close(c->fd);
+    contaMemoriaPartilhada(MEM_ENTRADA, -(long long)(sizeof(ConexaoAnel) + c->capacidade));
+    while(c->envios) {
+        EnvioAnel *e = c->envios;
+        c->envios = e->next;
+        contaMemoriaPartilhada(MEM_SAIDA, -(long long)(sizeof(EnvioAnel) + e->capacidade));
+        free(e);
+    }
+    free(c->recebido);
+    pthread_mutex_destroy(&c->mutex);
+    pthread_cond_destroy(&c->mudou);
+    free(c);
+}
+
+// Acrescenta à fila de receção da conexão (c->mutex trancado)
+int guardaRecebido(ConexaoAnel *c, const char *dados, size_t n) {
+    if(c->inicio > 0) {
+        memmove(c->recebido, c->recebido + c->inicio, c->fim - c->inicio);
+        c->fim -= c->inicio;
+        c->inicio = 0;
+    }
+    if(c->fim + n > c->capacidade) {
+        size_t novaCap = c->capacidade ? c->capacidade * 2 : TAM_BUFFER_ANEL;
+        while(novaCap < c->fim + n) novaCap *= 2;
+        char *novo = (char*)realloc(c->recebido, novaCap);
+        if(!novo) return 0;
+        contaMemoriaPartilhada(MEM_ENTRADA, novaCap - c->capacidade);
+        c->recebido = novo;
+        c->capacidade = novaCap;
+    }
+    memcpy(c->recebido + c->fim, dados, n);
+    c->fim += n;
+    return 1;
+}
+
+void recebeuAnel(ConexaoAnel *c, struct io_uring_cqe *cqe) {
+    pthread_mutex_lock(&c->mutex);
+    c->recebeAtivo = 0;
+    if(cqe->res > 0 && (cqe->flags & IORING_CQE_F_BUFFER)) {
+        unsigned short bid = (unsigned short)(cqe->flags >> IORING_CQE_BUFFER_SHIFT);
+        if(!guardaRecebido(c, anel.memoriaBuffers + (size_t)bid * TAM_BUFFER_ANEL, cqe->res)) {
+            c->fimEntrada = 1;
+        }
+        devolveBuffer(bid);
+    } else if(cqe->res != -ENOBUFS) {
+        // Fecho do cliente, erro, ou o shutdown de uma conexão largada
+        c->fimEntrada = 1;
+    }
+    pthread_cond_broadcast(&c->mudou);
+
+    // Sem buffers livres (-ENOBUFS) o recv volta já: os desta volta do ciclo
+    // foram devolvidos antes da próxima submissão
+    if(!c->fimEntrada && !c->largada) {
+        if(c->fim - c->inicio >= LIMITE_FILA_ANEL) c->recebePausado = 1;
+        else armaRecebe(c);
+    }
+    pthread_mutex_unlock(&c->mutex);
+    libertaSeLivre(c);
+}
+
+void enviouAnel(EnvioAnel *e, int res) {
+    ConexaoAnel *c = e->conexao;
+
+    pthread_mutex_lock(&c->mutex);
+    c->emCurso--;
+    if(res > 0) {
+        e->enviado += (size_t)res;
+        c->porEnviar -= (size_t)res;
+        if(e->enviado == e->tamanho) {
+            // As CQEs de uma cadeia chegam por ordem: e é a cabeça da fila
+            c->envios = e->next;
+            if(!c->envios) c->ultimoEnvio = NULL;
+            contaMemoriaPartilhada(MEM_SAIDA, -(long long)(sizeof(EnvioAnel) + e->capacidade));
+            free(e);
+        }
+    } else if(res != -ECANCELED) {
+        c->falhouEnvio = 1;
+    }
+
+    if(!c->emCurso) {
+        if(c->falhouEnvio) {
+            while(c->envios) {
+                EnvioAnel *x = c->envios;
+                c->envios = x->next;
+                contaMemoriaPartilhada(MEM_SAIDA, -(long long)(sizeof(EnvioAnel) + x->capacidade));
+                free(x);
+            }
+            c->ultimoEnvio = NULL;
+            c->porEnviar = 0;
+        } else if(c->envios) {
+            submeteEnvios(c);
+        }
+    }
+    pthread_cond_broadcast(&c->mudou);
+    pthread_mutex_unlock(&c->mutex);
+    libertaSeLivre(c);
+}
+
+// Conexão aceite pelo accept multishot: admissão, thread e primeiro recv
+void aceitouAnel(int fd) {
+    struct sockaddr_in endereco;
+    socklen_t len = sizeof(endereco);
+    if(getpeername(fd, (struct sockaddr*)&endereco, &len) < 0) {
+        close(fd);
+        return;
+    }
+
+    ConexaoAnel *c = (ConexaoAnel*)calloc(1, sizeof(ConexaoAnel));
+    if(!c) {
+        close(fd);
+        return;
+    }
+    c->fd = fd;
+    pthread_mutex_init(&c->mutex, NULL);
+    pthread_cond_init(&c->mudou, NULL);
+    contaMemoriaPartilhada(MEM_ENTRADA, sizeof(ConexaoAnel));
+
+    if(!despachaConexao(anel.socketEscuta, fd, endereco.sin_addr.s_addr, c)) {
+        contaMemoriaPartilhada(MEM_ENTRADA, -(long long)sizeof(ConexaoAnel));
+        pthread_mutex_destroy(&c->mutex);
+        pthread_cond_destroy(&c->mudou);
+        free(c);
+        return;
+    }
+    pthread_mutex_lock(&c->mutex);
+    armaRecebe(c);
+    pthread_mutex_unlock(&c->mutex);
+}
+
+// Trata as conexões agendadas pelas threads: envios novos, receção a
+// retomar e conexões largadas
+void trataAgenda(void) {
+    // Uma thread pode voltar a agendar a conexão logo que a agenda é
+    // largada, por isso a volta segue a sua própria ligação
+    ConexaoAnel *lista = NULL;
+    pthread_mutex_lock(&mutexAgenda);
+    for(ConexaoAnel *c = agendaAnel; c; c = c->proximaAgendada) {
+        c->agendada = 0;
+        c->largada = c->terminada;
+        c->seguinteVolta = lista;
+        lista = c;
+    }
+    agendaAnel = NULL;
+    pthread_mutex_unlock(&mutexAgenda);
+
+    while(lista) {
+        ConexaoAnel *c = lista;
+        lista = c->seguinteVolta;
+
+        pthread_mutex_lock(&c->mutex);
+        if(!c->emCurso && c->envios && !c->falhouEnvio) submeteEnvios(c);
+        if(!c->largada && !c->recebeAtivo && !c->recebePausado && !c->fimEntrada) armaRecebe(c);
+        pthread_mutex_unlock(&c->mutex);
+
+        // O recv pendente termina com 0 e a conexão é libertada na sua CQE
+        if(c->largada && c->recebeAtivo) shutdown(c->fd, SHUT_RDWR);
+        libertaSeLivre(c);
+    }
+}
+
+void trataCqe(struct io_uring_cqe *cqe) {
+    void *ptr = (void*)(uintptr_t)(cqe->user_data & ~(uint64_t)MASCARA_OP);
+
+    switch(cqe->user_data & MASCARA_OP) {
+        case OP_ACEITA:
+            if(cqe->res >= 0) aceitouAnel(cqe->res);
+            else if(cqe->res != -ECANCELED) fprintf(stderr, "Erro no accept: %s\n", strerror(-cqe->res));
+            if(!(cqe->flags & IORING_CQE_F_MORE)) {
+                anel.aceitaAtivo = 0;
+                if(!anel.aParar) armaAceita();
+            }
+            break;
+        case OP_RECEBE:
+            recebeuAnel((ConexaoAnel*)ptr, cqe);
+            break;
+        case OP_ENVIA:
+            enviouAnel((EnvioAnel*)ptr, cqe->res);
+            break;
+        case OP_ACORDA:
+            armaAcorda(); // a agenda é tratada em todas as voltas
+            break;
+        case OP_PARAGEM:
+            // Entregue a outro processo: as conexões em curso continuam no anel
+            anel.aParar = 1;
+            if(anel.aceitaAtivo) {
+                struct io_uring_sqe *sqe = preparaSqe(IORING_OP_ASYNC_CANCEL, -1, NULL, OP_CANCELA);
+                sqe->addr = OP_ACEITA;
+            }
+            break;
+        default:
+            break;
+    }
+}
+
+void* cicloAnel(void *arg) {
+    (void)arg;
+    armaAcorda();
+    armaParagem();
+    armaAceita();
+
+    while(1) {
+        trataAgenda();
+        if(entraAnel(1) < 0 && errno != EAGAIN) {
+            perror("Erro no io_uring_enter");
+            exit(1);
+        }
+
+        unsigned cabeca = *anel.cqCabeca;
+        unsigned cauda = __atomic_load_n(anel.cqCauda, __ATOMIC_ACQUIRE);
+        for(; cabeca != cauda; cabeca++) trataCqe(&anel.cqes[cabeca & anel.cqMascara]);
+        __atomic_store_n(anel.cqCabeca, cabeca, __ATOMIC_RELEASE);
+    }
+    return NULL;
+}
+
+// Cria o anel, regista o anel de buffers e arranca a thread do anel. Devolve
+// 0, com a razão em stderr, se o kernel não o suportar.
+int iniciaAnel(int sockfd) {
+    struct io_uring_params p;
+    memset(&p, 0, sizeof(p));
+    p.flags = IORING_SETUP_CQSIZE;
+    p.cq_entries = ENTRADAS_CQ_ANEL;
+
+    anel.fd = (int)syscall(__NR_io_uring_setup, ENTRADAS_ANEL, &p);
+    if(anel.fd < 0) {
+        fprintf(stderr, "io_uring indisponivel (io_uring_setup: %s)\n", strerror(errno));
+        return 0;
+    }
+    if(!(p.features & IORING_FEAT_SINGLE_MMAP) || !(p.features & IORING_FEAT_NODROP)) {
+        fprintf(stderr, "io_uring indisponivel (kernel demasiado antigo)\n");
+        close(anel.fd);
+        return 0;
+    }
+
+    size_t tamSq = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    size_t tamCq = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    size_t tamAneis = tamSq > tamCq ? tamSq : tamCq;
+    char *aneis = mmap(NULL, tamAneis, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                       anel.fd, IORING_OFF_SQ_RING);
+    anel.sqes = mmap(NULL, p.sq_entries * sizeof(struct io_uring_sqe), PROT_READ | PROT_WRITE,
+                     MAP_SHARED | MAP_POPULATE, anel.fd, IORING_OFF_SQES);
+    anel.buffers = mmap(NULL, NUM_BUFFERS_ANEL * sizeof(struct io_uring_buf), PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    anel.memoriaBuffers = malloc((size_t)NUM_BUFFERS_ANEL * TAM_BUFFER_ANEL);
+    if(aneis == MAP_FAILED || anel.sqes == MAP_FAILED || anel.buffers == MAP_FAILED || !anel.memoriaBuffers) {
+        fprintf(stderr, "io_uring indisponivel (sem memoria para os aneis)\n");
+        close(anel.fd);
+        return 0;
+    }
+
+    anel.entradasSq = p.sq_entries;
+    anel.sqCabeca = (unsigned*)(aneis + p.sq_off.head);
+    anel.sqCauda = (unsigned*)(aneis + p.sq_off.tail);
+    anel.sqMascara = *(unsigned*)(aneis + p.sq_off.ring_mask);
+    anel.sqLocal = *anel.sqCauda;
+    unsigned *indices = (unsigned*)(aneis + p.sq_off.array);
+    for(unsigned i = 0; i < p.sq_entries; i++) indices[i] = i; // SQE i na posição i
+    anel.cqCabeca = (unsigned*)(aneis + p.cq_off.head);
+    anel.cqCauda = (unsigned*)(aneis + p.cq_off.tail);
+    anel.cqMascara = *(unsigned*)(aneis + p.cq_off.ring_mask);
+    anel.cqes = (struct io_uring_cqe*)(aneis + p.cq_off.cqes);
+
+    // O anel de buffers (e o accept multishot, da mesma versão) exige o 5.19
+    struct io_uring_buf_reg registo;
+    memset(&registo, 0, sizeof(registo));
+    registo.ring_addr = (uint64_t)(uintptr_t)anel.buffers;
+    registo.ring_entries = NUM_BUFFERS_ANEL;
+    registo.bgid = GRUPO_BUFFERS_ANEL;
+    if(syscall(__NR_io_uring_register, anel.fd, IORING_REGISTER_PBUF_RING, &registo, 1) < 0) {
+        fprintf(stderr, "io_uring indisponivel (anel de buffers: %s)\n", strerror(errno));
+        close(anel.fd);
+        return 0;
+    }
+    for(unsigned short i = 0; i < NUM_BUFFERS_ANEL; i++) devolveBuffer(i);
+    contaMemoriaPartilhada(MEM_ANEL, (long long)NUM_BUFFERS_ANEL * TAM_BUFFER_ANEL);
+
+    acordaAnelFd = eventfd(0, EFD_CLOEXEC);
+    anel.socketEscuta = sockfd;
+    pthread_t thread;
+    if(acordaAnelFd < 0 || pthread_create(&thread, NULL, cicloAnel, NULL) != 0) {
+        fprintf(stderr, "io_uring indisponivel (sem thread para o anel)\n");
+        close(anel.fd);
+        return 0;
+    }
+    pthread_detach(thread);
+    return 1;
+}
+
+// --------------------------------------------------
+// Benchmark de logins (-b <n>)
+// --------------------------------------------------
+// Mede o débito do pool de autenticação como o veem as sessões: várias
+// threads verificam n senhas no total, cada uma à espera do seu hash.
+// Os pedidos recusados com a fila cheia são contados à parte.
+
+#define CLIENTES_BENCHMARK 16
+
+typedef struct EstadoBenchmark {
+    char hash[MAX_STR];
+    int restantes;
+    int recusados;
+    int falhados;
+    double esperaTotal; // soma das latências, protegida por mutex
+    pthread_mutex_t mutex;
+} EstadoBenchmark;
+
+void* clienteBenchmark(void *arg) {
+    EstadoBenchmark *b = (EstadoBenchmark*)arg;
+    while(__atomic_fetch_sub(&b->restantes, 1, __ATOMIC_RELAXED) > 0) {
+        double inicio = agoraMonotonico();
+        int r = verificaSenha("senha-benchmark", b->hash);
+        double espera = agoraMonotonico() - inicio;
+
+        pthread_mutex_lock(&b->mutex);
+        if(r == SENHA_OCUPADO) b->recusados++;
+        else if(r != SENHA_CORRETA) b->falhados++;
+        b->esperaTotal += espera;
+        pthread_mutex_unlock(&b->mutex);
+    }
+    return NULL;
+}
+
+void benchmarkLogin(int n) {
+    EstadoBenchmark b;
+    memset(&b, 0, sizeof(b));
+    pthread_mutex_init(&b.mutex, NULL);
+    strcpy(b.hash, "senha-benchmark");
+    if(!hashSenha(b.hash)) {
+        fprintf(stderr, "Erro ao calcular o hash do benchmark\n");
+        exit(1);
+    }
+    b.restantes = n;
+
+    pthread_t threads[CLIENTES_BENCHMARK];
+    double inicio = agoraMonotonico();
+    for(int i = 0; i < CLIENTES_BENCHMARK; i++) {
+        if(pthread_create(&threads[i], NULL, clienteBenchmark, &b) != 0) {
+            perror("Erro ao criar thread do benchmark");
+            exit(1);
+        }
+    }
+    for(int i = 0; i < CLIENTES_BENCHMARK; i++) pthread_join(threads[i], NULL);
+    double duracao = agoraMonotonico() - inicio;
+
+    printf("%d logins em %.2f s (%d threads de autenticacao, %d clientes): %.1f logins/s\n",
+           n, duracao, NUM_THREADS_AUTH, CLIENTES_BENCHMARK, n / duracao);
+    printf("Latencia media %.1f ms, %d recusados (fila cheia), %d falhados\n",
+           b.esperaTotal * 1000 / n, b.recusados, b.falhados);
+}
+
 // --------------------------------------------------
 // Função principal do servidor (F3: "main server deve enviar menus")
 // --------------------------------------------------
 int main(int argc, char *argv[])
 {
     if(argc < 2) {
-        fprintf(stderr, "Uso: %s <porta>\n", argv[0]);
+        fprintf(stderr, "Uso: %s <porta> [-i ficheiro_importacao]... "
+                        "[-p [endereco:]porta_replicacao | -r host:porta_replicacao] [-k ficheiro_segredo] "
+                        "[-u socket_controlo] [-a diretorio_anexos] "
+                        "[-m MiB] [-mu KiB] [-mc KiB] [-e uring|threads] [-b logins]\n", argv[0]);
         exit(1);
     }
 
     int port = atoi(argv[1]);
     int sockfd, newsockfd;
-    socklen_t clilen;
     struct sockaddr_in serv_addr, cli_addr;
+    int portaReplicacao = 0, comImportacao = 0;
+    const char *caminhoControlo = NULL;
+    int loginsBenchmark = 0;
 
-    // Cria socket
-    sockfd = socket(AF_INET, SOCK_STREAM, 0);
-    if(sockfd < 0) {
-        perror("Erro ao abrir socket");
+    // -i é tratado depois de criar o admin; -p e -r escolhem o modo de replicação
+    for(int i = 2; i < argc; i++) {
+        if(strcmp(argv[i], "-i") == 0 && i + 1 < argc) {
+            comImportacao = 1;
+            i++;
+        } else if(strcmp(argv[i], "-p") == 0 && i + 1 < argc && modoReplicacao == SEM_REPLICACAO) {
+            modoReplicacao = PRIMARIO;
+            i++;
+            if(!strchr(argv[i], ':')) portaReplicacao = atoi(argv[i]);
+            else if(sscanf(argv[i], "%15[^:]:%d", enderecoReplicacao, &portaReplicacao) != 2) {
+                fprintf(stderr, "Opcao invalida: -p %s\n", argv[i]);
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "-k") == 0 && i + 1 < argc) {
+            if(!leSegredo(argv[++i])) {
+                fprintf(stderr, "Nao foi possivel ler o segredo de replicacao de %s\n", argv[i]);
+                exit(1);
+            }
+        } else if(strcmp(argv[i], "-r") == 0 && i + 1 < argc && modoReplicacao == SEM_REPLICACAO &&
+                  sscanf(argv[i + 1], "%99[^:]:%d", estadoReplica.host, &estadoReplica.porta) == 2) {
+            modoReplicacao = REPLICA;
+            i++;
+        } else if(strcmp(argv[i], "-u") == 0 && i + 1 < argc) {
+            caminhoControlo = argv[++i];
+        } else if(strcmp(argv[i], "-a") == 0 && i + 1 < argc) {
+            diretorioAnexos = argv[++i];
+        } else if(strcmp(argv[i], "-m") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            orcamentoGlobal = atoll(argv[++i]) * 1024 * 1024;
+        } else if(strcmp(argv[i], "-mu") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            orcamentoUsuario = atoll(argv[++i]) * 1024;
+        } else if(strcmp(argv[i], "-mc") == 0 && i + 1 < argc && atoll(argv[i + 1]) > 0) {
+            orcamentoConexao = atoll(argv[++i]) * 1024;
+        } else if(strcmp(argv[i], "-e") == 0 && i + 1 < argc &&
+                  (strcmp(argv[i + 1], "uring") == 0 || strcmp(argv[i + 1], "threads") == 0)) {
+            usaAnel = strcmp(argv[++i], "uring") == 0;
+        } else if(strcmp(argv[i], "-b") == 0 && i + 1 < argc && atoi(argv[i + 1]) > 0) {
+            loginsBenchmark = atoi(argv[++i]);
+        } else {
+            fprintf(stderr, "Opcao invalida: %s\n", argv[i]);
+            exit(1);
+        }
+    }
+    if(orcamentoGlobal == 0) {
+        orcamentoGlobal = (long long)sysconf(_SC_PHYS_PAGES) * sysconf(_SC_PAGESIZE) / 2;
+    }
+    if(modoReplicacao != SEM_REPLICACAO && !segredoReplicacao[0]) {
+        fprintf(stderr, "A replicacao requer um segredo partilhado: -k ficheiro_segredo\n");
+        exit(1);
+    }
+    if(modoReplicacao == REPLICA && comImportacao) {
+        fprintf(stderr, "Uma replica recebe os dados do primario; -i nao e permitido\n");
+        exit(1);
+    }
+    if(modoReplicacao == REPLICA && caminhoControlo) {
+        fprintf(stderr, "Uma replica reinicia-se voltando a ligar ao primario; -u nao e permitido\n");
         exit(1);
     }
 
-    // Preenche serv_addr
-    memset(&serv_addr, 0, sizeof(serv_addr));
-    serv_addr.sin_family = AF_INET;
-    serv_addr.sin_addr.s_addr = INADDR_ANY;  // Recebe de qualquer interface
-    serv_addr.sin_port = htons(port);
+    // Um cliente que feche a conexão não pode derrubar o processo inteiro
+    signal(SIGPIPE, SIG_IGN);
+    inicializaSessoes();
+    iniciaPoolAuth();
+    preparaHashFicticio();
+    if(loginsBenchmark) {
+        benchmarkLogin(loginsBenchmark);
+        return 0;
+    }
 
-    // Faz bind
-    if(bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
-        perror("Erro no bind");
-        close(sockfd);
+    if(pipe(pipeParagem) < 0) {
+        perror("Erro ao criar pipe");
         exit(1);
     }
 
-    // Listen
-    listen(sockfd, 5);
-    printf("Servidor rodando na porta %d...\n", port);
-
     // Para fins de exemplo, criaremos um usuário Admin fixo
     {
         User *admin = (User*)malloc(sizeof(User));
@@ -661,41 +5539,98 @@ int main(int argc, char *argv[])
         admin->userType = ADMIN;
         strcpy(admin->assocData.login, "admin");
         strcpy(admin->assocData.senha, "admin");
-        admin->next = NULL;
+        if(!hashSenha(admin->assocData.senha)) {
+            fprintf(stderr, "Erro ao calcular hash da senha do admin\n");
+            exit(1);
+        }
         insereUsuario(admin);
     }
 
-    // Loop infinito aguardando conexões
-    while(1) {
-        clilen = sizeof(cli_addr);
-        newsockfd = accept(sockfd, (struct sockaddr*)&cli_addr, &clilen);
-        if(newsockfd < 0) {
-            perror("Erro no accept");
-            continue;
-        }
+    // Com -u, um servidor já a correr no mesmo caminho entrega-nos o lugar
+    int herdado = caminhoControlo && assumeServidor(caminhoControlo);
+    sockfd = socketClientes;
 
-        // Processa conexão em processo filho (fork) ou thread
-        int pid = fork();
-        if(pid < 0) {
-            perror("Erro no fork");
-            close(newsockfd);
-            continue;
+    if(!herdado) {
+        // Cria socket
+        sockfd = socket(AF_INET, SOCK_STREAM, 0);
+        if(sockfd < 0) {
+            perror("Erro ao abrir socket");
+            exit(1);
         }
 
-        if(pid == 0) {
-            // Processo filho
+        // Preenche serv_addr
+        memset(&serv_addr, 0, sizeof(serv_addr));
+        serv_addr.sin_family = AF_INET;
+        serv_addr.sin_addr.s_addr = INADDR_ANY;  // Recebe de qualquer interface
+        serv_addr.sin_port = htons(port);
+
+        // Faz bind
+        if(bind(sockfd, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) < 0) {
+            perror("Erro no bind");
             close(sockfd);
-            // Envia menu inicial
-            menuInicial(newsockfd);
+            exit(1);
+        }
 
-            close(newsockfd);
-            exit(0);
-        } else {
-            // Processo pai
-            close(newsockfd);
+        // Listen: fila longa, para aguentar as ligações que chegam durante um reinício
+        listen(sockfd, SOMAXCONN);
+        fcntl(sockfd, F_SETFL, O_NONBLOCK);
+        socketClientes = sockfd;
+        printf("Servidor rodando na porta %d...\n", port);
+
+        // Carga em massa antes de aceitar conexões (-i pode repetir-se)
+        for(int i = 2; i < argc; i++) {
+            if(strcmp(argv[i], "-i") == 0) {
+                importaFicheiro(argv[++i]);
+            } else {
+                i++;
+            }
+        }
+    } else {
+        if(comImportacao) fprintf(stderr, "Dados herdados do servidor anterior; -i ignorado\n");
+        // Herdar a porta de replicação faz deste processo o novo primário
+        if(socketReplicacao >= 0) modoReplicacao = PRIMARIO;
+        if(socketReplicacao >= 0 && !segredoReplicacao[0]) {
+            fprintf(stderr, "Sem -k as replicas nao se conseguem voltar a ligar\n");
+        }
+        printf("Servidor rodando na porta herdada...\n");
+    }
+
+    if(modoReplicacao != SEM_REPLICACAO) {
+        iniciaReplicacao(portaReplicacao);
+    }
+    if(caminhoControlo) {
+        abreControlo(caminhoControlo);
+    }
+    confirmaServidor();
+
+    // Com o anel as conexões são aceites pela thread do anel (o accept
+    // multishot deixa de ser armado quando pipeParagem fica legível)
+    int comAnel = usaAnel && iniciaAnel(sockfd);
+    if(usaAnel && !comAnel) fprintf(stderr, "A usar uma thread bloqueante por conexao.\n");
+    while(comAnel) {
+        struct pollfd paragem = { pipeParagem[0], POLLIN, 0 };
+        if(poll(&paragem, 1, -1) > 0) break;
+    }
+
+    // Loop infinito aguardando conexões
+    while(!comAnel) {
+        newsockfd = aceitaConexao(sockfd, &cli_addr);
+        if(newsockfd == ACEITE_PARAGEM) break;
+        if(newsockfd < 0) {
+            perror("Erro no accept");
+            continue;
         }
+
+        despachaConexao(sockfd, newsockfd, cli_addr.sin_addr.s_addr, NULL);
     }
 
+    // Substituído por um processo novo: as conexões em curso terminam aqui
     close(sockfd);
+    pthread_mutex_lock(&mutexConexoes);
+    if(conexoesAtivas > 0) printf("A aguardar %d conexoes em curso...\n", conexoesAtivas);
+    while(conexoesAtivas > 0) pthread_cond_wait(&conexoesMudaram, &mutexConexoes);
+    pthread_mutex_unlock(&mutexConexoes);
+
+    printf("Servidor entregue ao novo processo.\n");
     return 0;
 }